@@ -25,57 +25,36 @@
 #include <time.h>
 #include <unistd.h>
 #include <vector>
+#include "persist.h"
+#include "epoch.h"
 
 #define PAGESIZE 512
 
-#define CPU_FREQ_MHZ (1994)
 #define DELAY_IN_NS (1000)
 #define CACHE_LINE_SIZE 64
 #define QUERY_NUM 25
 
 #define IS_FORWARD(c) (c % 2 == 0)
 
+// a leaf a delete leaves with fewer than this share of its slots in use is
+// merged with a neighbour, if the two fit in 1 - MERGE_FILL of a node;
+// 0 turns merging off
+#ifndef MERGE_FILL
+#define MERGE_FILL 0.25
+#endif
+
 using entry_key_t = int64_t;
 
 pthread_mutex_t print_mtx;
 
-static inline void cpu_pause() { __asm__ volatile("pause" ::: "memory"); }
-static inline unsigned long read_tsc(void) {
-  unsigned long var;
-  unsigned int hi, lo;
-
-  asm volatile("rdtsc" : "=a"(lo), "=d"(hi));
-  var = ((unsigned long long int)hi << 32) | lo;
-
-  return var;
-}
-
-unsigned long write_latency_in_ns = 0;
 unsigned long long search_time_in_insert = 0;
 unsigned int gettime_cnt = 0;
 unsigned long long clflush_time_in_insert = 0;
 unsigned long long update_time_in_insert = 0;
-int clflush_cnt = 0;
 int node_cnt = 0;
 
 using namespace std;
 
-inline void mfence() { asm volatile("mfence" ::: "memory"); }
-
-inline void clflush(char *data, int len) {
-  volatile char *ptr = (char *)((unsigned long)data & ~(CACHE_LINE_SIZE - 1));
-  mfence();
-  for (; ptr < data + len; ptr += CACHE_LINE_SIZE) {
-    unsigned long etsc =
-        read_tsc() + (unsigned long)(write_latency_in_ns * CPU_FREQ_MHZ / 1000);
-    asm volatile("clflush %0" : "+m"(*(volatile char *)ptr));
-    while (read_tsc() < etsc)
-      cpu_pause();
-    //++clflush_cnt;
-  }
-  mfence();
-}
-
 class page;
 
 class btree {
@@ -87,11 +66,12 @@ public:
   btree();
   void setNewRoot(char *);
   void getNumberOfNodes();
-  void btree_insert(entry_key_t, char *);
+  bool btree_insert(entry_key_t, char *, bool upsert = false);
   void btree_insert_internal(char *, entry_key_t, char *, uint32_t);
   void btree_delete(entry_key_t);
   void btree_delete_internal(entry_key_t, char *, uint32_t, entry_key_t *,
                              bool *, page **);
+  void merge_leaves(entry_key_t);
   char *btree_search(entry_key_t);
   void btree_search_range(entry_key_t, entry_key_t, unsigned long *);
   void printAll();
@@ -176,6 +156,8 @@ public:
     return ret;
   }
 
+  void operator delete(void *p) { free(p); }
+
   inline int count() {
     uint8_t previous_switch_counter;
     int count = 0;
@@ -242,6 +224,10 @@ public:
   bool remove(btree *bt, entry_key_t key, bool only_rebalance = false,
               bool with_lock = true) {
     hdr.mtx->lock();
+    if (hdr.is_deleted) { // merged away, the caller descends again
+      hdr.mtx->unlock();
+      return false;
+    }
 
     bool ret = remove_key(key);
 
@@ -562,9 +548,28 @@ public:
     ++(*num_entries);
   }
 
-  // Insert a new key - FAST and FAIR
+  // Slot of key among the first n entries of this leaf, -1 if it is not
+  // there. The write lock must be held, so no shift is under way and the
+  // keys are in order.
+  inline int find_key(entry_key_t key, int n) {
+    int lo = 0, hi = n;
+    while (lo < hi) {
+      int mid = (lo + hi) / 2;
+      if (records[mid].key < key) {
+        lo = mid + 1;
+      } else {
+        hi = mid;
+      }
+    }
+    return (lo < n && records[lo].key == key) ? lo : -1;
+  }
+
+  // Insert a new key - FAST and FAIR. A key already in the leaf is not
+  // inserted again: *existed is set and, with upsert, its value is
+  // overwritten in place instead.
   page *store(btree *bt, char *left, entry_key_t key, char *right, bool flush,
-              bool with_lock, page *invalid_sibling = NULL) {
+              bool with_lock, page *invalid_sibling = NULL,
+              bool upsert = false, bool *existed = NULL) {
     if (with_lock) {
       hdr.mtx->lock(); // Lock the write lock
     }
@@ -578,18 +583,37 @@ public:
 
     // If this node has a sibling node,
     if (hdr.sibling_ptr && (hdr.sibling_ptr != invalid_sibling)) {
-      // Compare this key with the first key of the sibling
-      if (key > hdr.sibling_ptr->records[0].key) {
+      // Compare this key with the first key of the sibling; in a leaf an
+      // equal key is the sibling's
+      entry_key_t first = hdr.sibling_ptr->records[0].key;
+      if (key > first || (key == first && hdr.leftmost_ptr == NULL)) {
         if (with_lock) {
           hdr.mtx->unlock(); // Unlock the write lock
         }
         return hdr.sibling_ptr->store(bt, NULL, key, right, true, with_lock,
-                                      invalid_sibling);
+                                      invalid_sibling, upsert, existed);
       }
     }
 
     register int num_entries = count();
 
+    if (hdr.leftmost_ptr == NULL) {
+      int i = find_key(key, num_entries);
+      if (i >= 0) {
+        if (upsert) {
+          records[i].ptr = right;
+          clflush((char *)&records[i].ptr, sizeof(char *));
+        }
+        if (existed) {
+          *existed = true;
+        }
+        if (with_lock) {
+          hdr.mtx->unlock();
+        }
+        return this;
+      }
+    }
+
     // FAST
     if (num_entries < cardinality - 1) {
       insert_key(key, right, &num_entries, flush);
@@ -672,29 +696,41 @@ public:
     }
   }
 
-  // Search keys with linear search
+  // Search keys with linear search. A split or a merge moves keys across
+  // the sibling link, so a leaf is read again if its sibling changed while
+  // it was read. A merge copies the keys before it moves the link; copies
+  // already taken from the left leaf are skipped in the right one. A leaf
+  // read from right to left is finished before the scan stops at max.
   void linear_search_range(entry_key_t min, entry_key_t max,
                            unsigned long *buf) {
     int i, off = 0;
     uint8_t previous_switch_counter;
-    page *current = this;
+    page *current = this, *sibling;
+    entry_key_t floor = min, top; // keys up to floor have been taken
+    bool beyond; // a key not below max was seen
 
     while (current) {
+      emulate_nvm_read(); // each leaf of the scan is a node visit
       int old_off = off;
       do {
+        sibling = current->hdr.sibling_ptr;
         previous_switch_counter = current->hdr.switch_counter;
         off = old_off;
+        top = floor;
+        beyond = false;
 
         entry_key_t tmp_key;
         char *tmp_ptr;
 
         if (IS_FORWARD(previous_switch_counter)) {
-          if ((tmp_key = current->records[0].key) > min) {
+          if (current->records[0].ptr != NULL &&
+              (tmp_key = current->records[0].key) > floor) {
             if (tmp_key < max) {
               if ((tmp_ptr = current->records[0].ptr) != NULL) {
-                if (tmp_key == current->records[0].key) {
+                if (tmp_key == current->reread_key(0)) {
                   if (tmp_ptr) {
                     buf[off++] = (unsigned long)tmp_ptr;
+                    top = std::max(top, tmp_key);
                   }
                 }
               }
@@ -703,13 +739,15 @@ public:
           }
 
           for (i = 1; current->records[i].ptr != NULL; ++i) {
-            if ((tmp_key = current->records[i].key) > min) {
+            if ((tmp_key = current->records[i].key) > floor) {
               if (tmp_key < max) {
                 if ((tmp_ptr = current->records[i].ptr) !=
                     current->records[i - 1].ptr) {
-                  if (tmp_key == current->records[i].key) {
-                    if (tmp_ptr)
+                  if (tmp_key == current->reread_key(i)) {
+                    if (tmp_ptr) {
                       buf[off++] = (unsigned long)tmp_ptr;
+                      top = std::max(top, tmp_key);
+                    }
                   }
                 }
               } else
@@ -717,40 +755,58 @@ public:
             }
           }
         } else {
-          for (i = count() - 1; i > 0; --i) {
-            if ((tmp_key = current->records[i].key) > min) {
+          for (i = current->count() - 1; i > 0; --i) {
+            if ((tmp_key = current->records[i].key) > floor) {
               if (tmp_key < max) {
                 if ((tmp_ptr = current->records[i].ptr) !=
                     current->records[i - 1].ptr) {
-                  if (tmp_key == current->records[i].key) {
-                    if (tmp_ptr)
+                  if (tmp_key == current->reread_key(i)) {
+                    if (tmp_ptr) {
                       buf[off++] = (unsigned long)tmp_ptr;
+                      top = std::max(top, tmp_key);
+                    }
                   }
                 }
-              } else
-                return;
+              } else {
+                beyond = true;
+              }
             }
           }
 
-          if ((tmp_key = current->records[0].key) > min) {
+          if (current->records[0].ptr != NULL &&
+              (tmp_key = current->records[0].key) > floor) {
             if (tmp_key < max) {
               if ((tmp_ptr = current->records[0].ptr) != NULL) {
-                if (tmp_key == current->records[0].key) {
+                if (tmp_key == current->reread_key(0)) {
                   if (tmp_ptr) {
                     buf[off++] = (unsigned long)tmp_ptr;
+                    top = std::max(top, tmp_key);
                   }
                 }
               }
-            } else
-              return;
+            } else {
+              beyond = true;
+            }
           }
         }
-      } while (previous_switch_counter != current->hdr.switch_counter);
+      } while (previous_switch_counter != current->hdr.switch_counter ||
+               sibling != current->hdr.sibling_ptr);
 
-      current = current->hdr.sibling_ptr;
+      if (beyond) {
+        return;
+      }
+      floor = top;
+      current = sibling;
     }
   }
 
+  // Read key i again, from memory: the key-pointer-key check that rejects a
+  // slot a FAST shift rewrote in between is void if the compiler reuses the
+  // first read
+  inline entry_key_t reread_key(int i) {
+    return *(volatile entry_key_t *)&records[i].key;
+  }
+
   char *linear_search(entry_key_t key) {
     int i = 1;
     uint8_t previous_switch_counter;
@@ -758,6 +814,8 @@ public:
     char *t;
     entry_key_t k;
 
+    emulate_nvm_read();
+
     if (hdr.leftmost_ptr == NULL) { // Search a leaf node
       do {
         previous_switch_counter = hdr.switch_counter;
@@ -767,7 +825,7 @@ public:
         if (IS_FORWARD(previous_switch_counter)) {
           if ((k = records[0].key) == key) {
             if ((t = records[0].ptr) != NULL) {
-              if (k == records[0].key) {
+              if (k == reread_key(0)) {
                 ret = t;
                 continue;
               }
@@ -777,7 +835,7 @@ public:
           for (i = 1; records[i].ptr != NULL; ++i) {
             if ((k = records[i].key) == key) {
               if (records[i - 1].ptr != (t = records[i].ptr)) {
-                if (k == records[i].key) {
+                if (k == reread_key(i)) {
                   ret = t;
                   break;
                 }
@@ -788,7 +846,7 @@ public:
           for (i = count() - 1; i > 0; --i) {
             if ((k = records[i].key) == key) {
               if (records[i - 1].ptr != (t = records[i].ptr) && t) {
-                if (k == records[i].key) {
+                if (k == reread_key(i)) {
                   ret = t;
                   break;
                 }
@@ -799,7 +857,7 @@ public:
           if (!ret) {
             if ((k = records[0].key) == key) {
               if (NULL != (t = records[0].ptr) && t) {
-                if (k == records[0].key) {
+                if (k == reread_key(0)) {
                   ret = t;
                   continue;
                 }
@@ -844,15 +902,19 @@ public:
             continue;
           }
         } else { // search from right to left
+          // a merge deletes from internal nodes; the key is read again so
+          // that it is not paired with the pointer a shift moved over it
           for (i = count() - 1; i >= 0; --i) {
             if (key >= (k = records[i].key)) {
               if (i == 0) {
-                if ((char *)hdr.leftmost_ptr != (t = records[i].ptr)) {
+                if ((char *)hdr.leftmost_ptr != (t = records[i].ptr) &&
+                    k == reread_key(i)) {
                   ret = t;
                   break;
                 }
               } else {
-                if (records[i - 1].ptr != (t = records[i].ptr)) {
+                if (records[i - 1].ptr != (t = records[i].ptr) &&
+                    k == reread_key(i)) {
                   ret = t;
                   break;
                 }
@@ -931,6 +993,7 @@ void btree::setNewRoot(char *new_root) {
 }
 
 char *btree::btree_search(entry_key_t key) {
+  epoch_guard guard;
   page *p = (page *)root;
 
   while (p->hdr.leftmost_ptr != NULL) {
@@ -953,17 +1016,23 @@ char *btree::btree_search(entry_key_t key) {
   return (char *)t;
 }
 
-// insert the key in the leaf node
-void btree::btree_insert(entry_key_t key, char *right) { // need to be string
+// insert the key in the leaf node; false if it is already in the tree, in
+// which case only upsert overwrites its value
+bool btree::btree_insert(entry_key_t key, char *right,
+                         bool upsert) { // need to be string
+  epoch_guard guard;
   page *p = (page *)root;
 
   while (p->hdr.leftmost_ptr != NULL) {
     p = (page *)p->linear_search(key);
   }
 
-  if (!p->store(this, NULL, key, right, true, true)) { // store
-    btree_insert(key, right);
+  bool existed = false;
+  if (!p->store(this, NULL, key, right, true, true, NULL, upsert,
+                &existed)) { // store
+    return btree_insert(key, right, upsert);
   }
+  return !existed;
 }
 
 // store the key into the node at the given level
@@ -983,6 +1052,7 @@ void btree::btree_insert_internal(char *left, entry_key_t key, char *right,
 }
 
 void btree::btree_delete(entry_key_t key) {
+  epoch_guard guard;
   page *p = (page *)root;
 
   while (p->hdr.leftmost_ptr != NULL) {
@@ -999,12 +1069,84 @@ void btree::btree_delete(entry_key_t key) {
   if (p) {
     if (!p->remove(this, key)) {
       btree_delete(key);
+    } else if (p->count() < MERGE_FILL * cardinality) {
+      merge_leaves(key);
     }
   } else {
     printf("not found the key to delete %lu\n", key);
   }
 }
 
+// Merge the leaf key belongs to with a neighbour under the same parent,
+// if the two fit in 1 - MERGE_FILL of a node. The parent, the left and the
+// right leaf are locked in that order, which no other writer reverses.
+//
+// The right leaf's entries are appended to the left one, its parent entry
+// is removed and the left sibling pointer steps over it. The right leaf
+// itself is not changed, only marked deleted, so readers still inside it
+// find its keys; it is deleted once they have all left.
+void btree::merge_leaves(entry_key_t key) {
+  page *parent = (page *)root;
+  if (parent->hdr.level == 0) {
+    return;
+  }
+  while (parent->hdr.level > 1) {
+    parent = (page *)parent->linear_search(key);
+  }
+
+  // the parent keeps at least one entry, as its first key is what its left
+  // sibling routes by
+  parent->hdr.mtx->lock();
+  page *sibling = parent->hdr.sibling_ptr;
+  int n = parent->count();
+  if (parent->hdr.is_deleted || n < 2 ||
+      (sibling && key >= sibling->records[0].key)) {
+    parent->hdr.mtx->unlock();
+    return;
+  }
+
+  // the leaf of key and the one before it, or the one after it if key is
+  // in the leftmost leaf; the right one is the child at slot
+  int slot = 0;
+  while (slot + 1 < n && parent->records[slot + 1].key <= key) {
+    ++slot;
+  }
+  page *left = (slot == 0) ? parent->hdr.leftmost_ptr
+                           : (page *)parent->records[slot - 1].ptr;
+  page *right = (page *)parent->records[slot].ptr;
+
+  left->hdr.mtx->lock();
+  right->hdr.mtx->lock();
+  int left_num_entries = left->count();
+  int right_num_entries = right->count();
+  bool merged = false;
+  if (!left->hdr.is_deleted && !right->hdr.is_deleted &&
+      left->hdr.sibling_ptr == right &&
+      left_num_entries + right_num_entries <=
+          (1 - MERGE_FILL) * (cardinality - 1)) {
+    for (int i = 0; i < right_num_entries; ++i) {
+      left->insert_key(right->records[i].key, right->records[i].ptr,
+                       &left_num_entries);
+    }
+
+    parent->remove_key(parent->records[slot].key);
+
+    left->hdr.sibling_ptr = right->hdr.sibling_ptr;
+    clflush((char *)&(left->hdr.sibling_ptr), sizeof(page *));
+
+    right->hdr.is_deleted = 1;
+    clflush((char *)&(right->hdr.is_deleted), sizeof(uint8_t));
+    merged = true;
+  }
+  right->hdr.mtx->unlock();
+  left->hdr.mtx->unlock();
+  parent->hdr.mtx->unlock();
+
+  if (merged) {
+    epoch_retire(right, [](void *p) { delete (page *)p; });
+  }
+}
+
 void btree::btree_delete_internal(entry_key_t key, char *ptr, uint32_t level,
                                   entry_key_t *deleted_key,
                                   bool *is_leftmost_node, page **left_sibling) {
@@ -1053,6 +1195,7 @@ void btree::btree_delete_internal(entry_key_t key, char *ptr, uint32_t level,
 // Function to search keys from "min" to "max"
 void btree::btree_search_range(entry_key_t min, entry_key_t max,
                                unsigned long *buf) {
+  epoch_guard guard;
   page *p = (page *)root;
 
   while (p) {
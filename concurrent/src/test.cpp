@@ -11,6 +11,15 @@ void clear_cache() {
   delete[] garbage;
 }
 
+// Report the flushes and fences issued per operation since the last
+// report, and start counting afresh
+void print_persist_stats(long ops) {
+  persist_stats s = read_persist_stats();
+  cout << "Flushes per op = " << (double)s.flushes / ops
+       << ", fences per op = " << (double)s.fences / ops << endl;
+  reset_persist_stats();
+}
+
 // MAIN
 int main(int argc, char **argv) {
   // Parsing arguments
@@ -25,7 +34,7 @@ int main(int argc, char **argv) {
       numData = atoi(optarg);
       break;
     case 'w':
-      write_latency_in_ns = atol(optarg);
+      parse_nvm_model(optarg);
       break;
     case 't':
       n_threads = atoi(optarg);
@@ -37,6 +46,8 @@ int main(int argc, char **argv) {
     }
   }
 
+  cout << "Flush instruction: " << flush_insn_names[flush_insn] << endl;
+
   btree *bt;
   bt = new btree();
 
@@ -58,7 +69,7 @@ int main(int argc, char **argv) {
   ifs.close();
 
   // Initializing stats
-  clflush_cnt = 0;
+  reset_persist_stats();
   search_time_in_insert = 0;
   clflush_time_in_insert = 0;
   gettime_cnt = 0;
@@ -76,6 +87,7 @@ int main(int argc, char **argv) {
   clock_gettime(CLOCK_MONOTONIC, &end);
   long long elapsedTime =
       (end.tv_sec - start.tv_sec) * 1000000000 + (end.tv_nsec - start.tv_nsec);
+  print_persist_stats(half_num_data);
 
   clear_cache();
 
@@ -109,6 +121,7 @@ int main(int argc, char **argv) {
       (end.tv_sec - start.tv_sec) * 1000000000 + (end.tv_nsec - start.tv_nsec);
   cout << "Concurrent searching with " << n_threads
        << " threads (usec) : " << elapsedTime / 1000 << endl;
+  print_persist_stats(half_num_data);
 
   clear_cache();
   futures.clear();
@@ -137,6 +150,7 @@ int main(int argc, char **argv) {
       (end.tv_sec - start.tv_sec) * 1000000000 + (end.tv_nsec - start.tv_nsec);
   cout << "Concurrent inserting with " << n_threads
        << " threads (usec) : " << elapsedTime / 1000 << endl;
+  print_persist_stats(half_num_data);
 #else
   clock_gettime(CLOCK_MONOTONIC, &start);
 
@@ -194,6 +208,7 @@ int main(int argc, char **argv) {
       (end.tv_sec - start.tv_sec) * 1000000000 + (end.tv_nsec - start.tv_nsec);
   cout << "Concurrent inserting and searching with " << n_threads
        << " threads (usec) : " << elapsedTime / 1000 << endl;
+  print_persist_stats(half_num_data);
 #endif
 
   delete bt;
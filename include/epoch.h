@@ -0,0 +1,170 @@
+#pragma once
+
+// Epoch-based reclamation of nodes that lock-free readers may still hold,
+// shared by the concurrent and new_concurrent_pmdk variants: the caller
+// passes the function that frees a node, delete on DRAM or the slab
+// allocator's Free in the pool, tagged with the pool it belongs to.
+//
+// Every operation on a tree runs inside an epoch_guard, which announces
+// the global epoch the thread entered in. A node taken out of the tree is
+// handed to epoch_retire() with the function that frees it, and is freed
+// once the global epoch has moved two steps past the one it was retired
+// in: by then every thread that could have reached it has left. The epoch
+// only moves when every thread inside a guard has seen the current one,
+// which is checked every EPOCH_RETIRE_BATCH retirements.
+//
+// Guards nest and belong to the thread that made them. A thread that exits
+// frees what it can and leaves the rest to the others, so memory stays
+// bounded by what the threads in a guard may still be reading, plus fewer
+// than EPOCH_RETIRE_BATCH nodes per thread.
+
+#include <atomic>
+#include <mutex>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <vector>
+
+#ifndef EPOCH_MAX_THREADS
+#define EPOCH_MAX_THREADS 256
+#endif
+
+// retirements between attempts to move the epoch and free nodes
+#ifndef EPOCH_RETIRE_BATCH
+#define EPOCH_RETIRE_BATCH 64
+#endif
+
+struct retired_node {
+  void *ptr;
+  void (*free_fn)(void *);
+  void (*free_tagged)(void *, uint64_t); // called with tag instead, if set
+  uint64_t tag;
+  uint64_t epoch;
+};
+
+// Epoch a thread entered in, 0 while it is outside any guard
+struct alignas(64) epoch_slot {
+  std::atomic<uint64_t> epoch;
+  std::atomic<bool> used;
+};
+
+std::atomic<uint64_t> global_epoch(1);
+epoch_slot epoch_slots[EPOCH_MAX_THREADS];
+
+// retired nodes of threads that have exited
+std::mutex orphan_mtx;
+std::vector<retired_node> orphan_nodes;
+
+// Free the nodes retired at least two epochs before now, oldest first
+static inline void free_retired(std::vector<retired_node> &nodes,
+                                uint64_t now) {
+  size_t n = 0;
+  while (n < nodes.size() && nodes[n].epoch + 2 <= now) {
+    if (nodes[n].free_tagged != NULL) {
+      nodes[n].free_tagged(nodes[n].ptr, nodes[n].tag);
+    } else {
+      nodes[n].free_fn(nodes[n].ptr);
+    }
+    ++n;
+  }
+  nodes.erase(nodes.begin(), nodes.begin() + n);
+}
+
+// Move the global epoch on if every thread in a guard has seen it
+inline uint64_t epoch_try_advance() {
+  uint64_t now = global_epoch.load();
+  for (int i = 0; i < EPOCH_MAX_THREADS; ++i) {
+    uint64_t e = epoch_slots[i].epoch.load();
+    if (e != 0 && e != now) {
+      return now;
+    }
+  }
+  global_epoch.compare_exchange_strong(now, now + 1);
+  return global_epoch.load();
+}
+
+// A thread's slot and the nodes it retired. What is left of them when the
+// thread exits goes to the orphans.
+struct epoch_thread {
+  epoch_slot *slot;
+  int depth;
+  std::vector<retired_node> retired;
+
+  epoch_thread() : slot(NULL), depth(0) {
+    for (int i = 0; i < EPOCH_MAX_THREADS; ++i) {
+      bool expected = false;
+      if (epoch_slots[i].used.compare_exchange_strong(expected, true)) {
+        slot = &epoch_slots[i];
+        slot->epoch = 0;
+        return;
+      }
+    }
+    fprintf(stderr, "more than %d threads use the tree\n", EPOCH_MAX_THREADS);
+    abort();
+  }
+
+  ~epoch_thread() {
+    free_retired(retired, epoch_try_advance());
+    std::lock_guard<std::mutex> lock(orphan_mtx);
+    orphan_nodes.insert(orphan_nodes.end(), retired.begin(), retired.end());
+    slot->used = false;
+  }
+};
+
+thread_local epoch_thread my_epoch;
+
+inline void epoch_enter() {
+  epoch_thread &t = my_epoch;
+  if (t.depth++ == 0) {
+    // announce, then make sure the epoch did not move on before the
+    // announcement could be seen
+    uint64_t e;
+    do {
+      e = global_epoch.load();
+      t.slot->epoch.store(e);
+    } while (global_epoch.load() != e);
+  }
+}
+
+inline void epoch_exit() {
+  epoch_thread &t = my_epoch;
+  if (--t.depth == 0) {
+    t.slot->epoch.store(0, std::memory_order_release);
+  }
+}
+
+inline void epoch_retire(const retired_node &node) {
+  epoch_thread &t = my_epoch;
+  t.retired.push_back(node);
+  t.retired.back().epoch = global_epoch.load();
+  if (t.retired.size() % EPOCH_RETIRE_BATCH != 0) {
+    return;
+  }
+
+  uint64_t now = epoch_try_advance();
+  free_retired(t.retired, now);
+  std::unique_lock<std::mutex> lock(orphan_mtx, std::try_to_lock);
+  if (lock.owns_lock()) {
+    free_retired(orphan_nodes, now);
+  }
+}
+
+// Free ptr with free_fn once no thread can be reading it
+inline void epoch_retire(void *ptr, void (*free_fn)(void *)) {
+  epoch_retire(retired_node{ptr, free_fn, NULL, 0, 0});
+}
+
+// The same with free_fn(ptr, tag), for a free function that has to know
+// where ptr came from, such as the pool, which may be gone by then
+inline void epoch_retire(void *ptr, void (*free_fn)(void *, uint64_t),
+                         uint64_t tag) {
+  epoch_retire(retired_node{ptr, NULL, free_fn, tag, 0});
+}
+
+class epoch_guard {
+public:
+  epoch_guard() { epoch_enter(); }
+  epoch_guard(const epoch_guard &) { epoch_enter(); }
+  epoch_guard &operator=(const epoch_guard &) { return *this; }
+  ~epoch_guard() { epoch_exit(); }
+};
@@ -0,0 +1,280 @@
+#pragma once
+
+// Persistence primitives shared by the single, concurrent and
+// new_concurrent_pmdk variants.
+//
+// clflush() writes a range back to memory and orders it before the stores
+// that follow. Which write-back instruction is used is decided once, by
+// CPUID, at startup: clwb, which leaves the line in the cache so the next
+// read of a just-written node still hits, then clflushopt, then clflush.
+// The first two are weakly ordered and need an sfence to take effect
+// before later stores; clflush is ordered by itself and needs none.
+//
+// Where several ranges only have to be durable together, write them back
+// with flush_lines() and finish with a single persist_fence().
+//
+// As in PMDK, PMEM_NO_CLWB=1 and PMEM_NO_CLFLUSHOPT=1 in the environment
+// rule out the newer instructions, e.g. to compare against plain clflush.
+//
+// On a machine without NVM the flush path can also emulate its cost; see
+// nvm_model below.
+
+#include <algorithm>
+#include <atomic>
+#include <cpuid.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#ifndef CACHE_LINE_SIZE
+#define CACHE_LINE_SIZE 64
+#endif
+
+#define XPLINE_SIZE 256
+
+static inline void cpu_pause() { __asm__ volatile("pause" ::: "memory"); }
+
+static inline unsigned long read_tsc(void) {
+  unsigned long var;
+  unsigned int hi, lo;
+
+  asm volatile("rdtsc" : "=a"(lo), "=d"(hi));
+  var = ((unsigned long long int)hi << 32) | lo;
+
+  return var;
+}
+
+// NVM emulation on DRAM, off while every field is 0.
+//
+// Every line written back waits write_latency_ns, and every node a search
+// visits waits read_latency_ns, once per node since its lines are fetched
+// in parallel. A thread can not write back faster than bandwidth_mbps: its
+// write-backs queue behind each other at that rate, overlapping with the
+// latency. With xpline set, writes are charged the way 3D XPoint media
+// takes them, as 256-byte XPLines: the first line a thread writes into an
+// XPLine pays the latency and 256 bytes of bandwidth, and further lines of
+// the same XPLine are combined with it for free.
+struct nvm_model_t {
+  unsigned long write_latency_ns;
+  unsigned long read_latency_ns;
+  unsigned long bandwidth_mbps; // per thread
+  bool xpline;
+};
+
+nvm_model_t nvm_model = {0, 0, 0, false};
+
+// The model in TSC cycles, set up by set_nvm_model()
+struct nvm_cycles_t {
+  bool write_enabled;
+  unsigned long write;
+  unsigned long read;
+  double per_byte;
+};
+
+nvm_cycles_t nvm_cycles = {false, 0, 0, 0.0};
+
+struct nvm_thread_state {
+  unsigned long bandwidth_free; // TSC at which earlier writes have drained
+  uintptr_t last_xpline;
+};
+
+thread_local nvm_thread_state my_nvm_state = {0, 0};
+
+// TSC ticks per nanosecond, measured against CLOCK_MONOTONIC
+static double calibrate_tsc() {
+  struct timespec start, now;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  unsigned long tsc_start = read_tsc();
+  long long elapsed;
+  do {
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    elapsed = (now.tv_sec - start.tv_sec) * 1000000000LL +
+              (now.tv_nsec - start.tv_nsec);
+  } while (elapsed < 20 * 1000 * 1000);
+  return (double)(read_tsc() - tsc_start) / elapsed;
+}
+
+inline void set_nvm_model(const nvm_model_t &model) {
+  nvm_model = model;
+  if (model.write_latency_ns == 0 && model.read_latency_ns == 0 &&
+      model.bandwidth_mbps == 0 && !model.xpline) {
+    nvm_cycles = {false, 0, 0, 0.0};
+    return;
+  }
+
+  double tsc_per_ns = calibrate_tsc();
+  nvm_cycles.write = (unsigned long)(model.write_latency_ns * tsc_per_ns);
+  nvm_cycles.read = (unsigned long)(model.read_latency_ns * tsc_per_ns);
+  // MB/s is bytes per microsecond
+  nvm_cycles.per_byte =
+      model.bandwidth_mbps ? tsc_per_ns * 1000 / model.bandwidth_mbps : 0.0;
+  nvm_cycles.write_enabled = model.write_latency_ns != 0 ||
+                             model.bandwidth_mbps != 0 || model.xpline;
+}
+
+// Parse the -w argument of the test drivers:
+//   write_ns[,read_ns[,MB/s per thread[,xpline]]]
+// e.g. "-w 300" (the old meaning) or "-w 300,170,2000,xpline"
+inline void parse_nvm_model(const char *arg) {
+  char buf[128];
+  strncpy(buf, arg, sizeof(buf) - 1);
+  buf[sizeof(buf) - 1] = '\0';
+
+  nvm_model_t model = {0, 0, 0, false};
+  unsigned long *fields[] = {&model.write_latency_ns, &model.read_latency_ns,
+                             &model.bandwidth_mbps};
+  int n = 0;
+  for (char *tok = strtok(buf, ","); tok != NULL; tok = strtok(NULL, ",")) {
+    if (strcmp(tok, "xpline") == 0) {
+      model.xpline = true;
+    } else if (n < 3) {
+      *fields[n++] = strtoul(tok, NULL, 10);
+    }
+  }
+  set_nvm_model(model);
+  printf("NVM emulation: write %lu ns, read %lu ns, bandwidth %lu MB/s%s\n",
+         model.write_latency_ns, model.read_latency_ns, model.bandwidth_mbps,
+         model.xpline ? ", 256-byte XPLines" : "");
+}
+
+// Charge the write-back of the line at ptr
+static inline void emulate_nvm_write(const char *ptr) {
+  nvm_thread_state &st = my_nvm_state;
+  unsigned long latency = nvm_cycles.write;
+  unsigned long bytes = CACHE_LINE_SIZE;
+  if (nvm_model.xpline) {
+    uintptr_t xpline = (uintptr_t)ptr / XPLINE_SIZE;
+    if (xpline == st.last_xpline) {
+      return;
+    }
+    st.last_xpline = xpline;
+    bytes = XPLINE_SIZE;
+  }
+
+  unsigned long now = read_tsc();
+  unsigned long start = std::max(now, st.bandwidth_free);
+  st.bandwidth_free = start + (unsigned long)(bytes * nvm_cycles.per_byte);
+  unsigned long until = std::max(now + latency, st.bandwidth_free);
+  while (read_tsc() < until)
+    cpu_pause();
+}
+
+// Charge a visit to a node; called once per node a traversal reads
+static inline void emulate_nvm_read() {
+  if (nvm_cycles.read == 0) {
+    return;
+  }
+  unsigned long until = read_tsc() + nvm_cycles.read;
+  while (read_tsc() < until)
+    cpu_pause();
+}
+
+enum flush_insn_t { FLUSH_CLFLUSH, FLUSH_CLFLUSHOPT, FLUSH_CLWB };
+
+const char *const flush_insn_names[] = {"clflush", "clflushopt", "clwb"};
+
+static inline bool env_set(const char *name) {
+  const char *v = getenv(name);
+  return v != NULL && strcmp(v, "1") == 0;
+}
+
+static flush_insn_t detect_flush_insn() {
+  unsigned int eax, ebx, ecx, edx;
+  if (!__get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx)) {
+    return FLUSH_CLFLUSH;
+  }
+  if ((ebx & (1u << 24)) && !env_set("PMEM_NO_CLWB")) {
+    return FLUSH_CLWB;
+  }
+  if ((ebx & (1u << 23)) && !env_set("PMEM_NO_CLFLUSHOPT")) {
+    return FLUSH_CLFLUSHOPT;
+  }
+  return FLUSH_CLFLUSH;
+}
+
+const flush_insn_t flush_insn = detect_flush_insn();
+
+// Flushed lines and issued fences. Each thread counts its own and adds
+// them to the retired totals when it exits.
+struct persist_stats {
+  uint64_t flushes;
+  uint64_t fences;
+};
+
+std::atomic<uint64_t> retired_flushes(0);
+std::atomic<uint64_t> retired_fences(0);
+
+struct thread_persist_stats : persist_stats {
+  thread_persist_stats() : persist_stats{0, 0} {}
+  ~thread_persist_stats() {
+    retired_flushes += flushes;
+    retired_fences += fences;
+  }
+};
+
+thread_local thread_persist_stats my_persist_stats;
+
+// Counts of the threads that have exited plus the calling thread
+inline persist_stats read_persist_stats() {
+  persist_stats s;
+  s.flushes = retired_flushes + my_persist_stats.flushes;
+  s.fences = retired_fences + my_persist_stats.fences;
+  return s;
+}
+
+inline void reset_persist_stats() {
+  retired_flushes = 0;
+  retired_fences = 0;
+  my_persist_stats.flushes = 0;
+  my_persist_stats.fences = 0;
+}
+
+inline void mfence() { asm volatile("mfence" ::: "memory"); }
+
+inline void sfence() { asm volatile("sfence" ::: "memory"); }
+
+// Start writing back every line of [data, data + len). Nothing is ordered
+// until the next persist_fence().
+inline void flush_lines(const void *data, size_t len) {
+  char *ptr = (char *)((unsigned long)data & ~(CACHE_LINE_SIZE - 1));
+  char *end = (char *)data + len;
+  for (; ptr < end; ptr += CACHE_LINE_SIZE) {
+    // clwb and clflushopt are encoded by hand, as PMDK does, so that no
+    // -m flag is needed to build
+    switch (flush_insn) {
+    case FLUSH_CLWB:
+      asm volatile(".byte 0x66; xsaveopt %0"
+                   : "+m"(*(volatile char *)ptr)::"memory");
+      break;
+    case FLUSH_CLFLUSHOPT:
+      asm volatile(".byte 0x66; clflush %0"
+                   : "+m"(*(volatile char *)ptr)::"memory");
+      break;
+    default:
+      asm volatile("clflush %0" : "+m"(*(volatile char *)ptr)::"memory");
+      break;
+    }
+    if (nvm_cycles.write_enabled) {
+      emulate_nvm_write(ptr);
+    }
+    ++my_persist_stats.flushes;
+  }
+}
+
+// Make the lines written back since the last fence durable before any
+// later store
+inline void persist_fence() {
+  if (flush_insn != FLUSH_CLFLUSH) {
+    sfence();
+    ++my_persist_stats.fences;
+  } else {
+    asm volatile("" ::: "memory");
+  }
+}
+
+inline void clflush(char *data, int len) {
+  flush_lines(data, len);
+  persist_fence();
+}
@@ -1,8 +1,12 @@
 #pragma once
 
+#include <atomic>
 #include <cstddef>
 #include <climits>
 #include <cstdlib>
+#include <cstring>
+#include <map>
+#include <mutex>
 #include <new>
 #include <vector>
 #include <string>
@@ -12,15 +16,28 @@
 #include "libpmemobj.h"
 
 #include "utils.h"
+#include "persist.h"
 
 // In this class, I will write a custom template allocator
 // Specifically, it allocates persistent memory using PMDK interface
-// Moreover, need to use static member to make all allocatoion in a single memory pool
+// Each pool is a PMPool handle; BasePMPool keeps a static interface to the
+// pool the calling thread works in
 
 static const char* layout_name = "template_pool";
 static const uint64_t pool_addr = 0x5f0000000000;
 static const char* pool_name = "/mnt/pmem0/baotong/fast-fair.data";
 static const uint64_t pool_size = 20UL * 1024 * 1024 * 1024;
+
+// Boundary every tree node starts on: a cache line, or XPLINE_SIZE so that
+// no two nodes share a 256-byte media line
+#ifndef NODE_ALIGN
+#define NODE_ALIGN CACHE_LINE_SIZE
+#endif
+
+// bytes of pool memory a PageSlab takes at a time
+#ifndef SLAB_CHUNK_SIZE
+#define SLAB_CHUNK_SIZE (4UL << 20)
+#endif
  
 namespace my_alloc{
 	template <class T1, class T2>
@@ -29,22 +46,190 @@ namespace my_alloc{
 	template <class T>
 	inline void _destroy(T* ptr){ ptr->~T();}
 
-    //Implement a base class that has the memory pool
-class BasePMPool{
+class PMPool;
+
+    // Where the pool lives and what happens to it on close. An existing file
+    // is opened, any other is created with size bytes. A nonzero addr asks
+    // for the pool to be mapped there, which needs the PMDK build with
+    // pmemobj_create_addr (-DPMDK_CREATE_ADDR); stock PMDK takes the address
+    // from PMEM_MMAP_HINT in the environment instead. Unless keep is set,
+    // closing the pool removes the file.
+struct pool_options{
+    std::string path = pool_name;
+    size_t size = pool_size;
+    uint64_t addr = 0;
+    bool keep = false;
+};
+
+    // The pool a thread works in: the one of the tree it is operating on,
+    // set by a pool_scope, or else the default pool that BasePMPool opens
+thread_local PMPool *scoped_pool = nullptr;
+PMPool *default_pool = nullptr;
+
+inline PMPool *CurrentPool() {
+    PMPool *p = scoped_pool;
+    return p ? p : default_pool;
+}
+
+    // Make p the current pool of the thread until the scope ends
+class pool_scope{
+    PMPool *saved;
+
 public:
-    static PMEMobjpool *pm_pool_;
-    static PMEMoid p_all_tables;
-    static char *all_tables;
-    static uint64_t all_allocated;
-    static uint64_t all_deallocated;
-    static uint64_t collect_allocated;
+    explicit pool_scope(PMPool *p) : saved(scoped_pool) { scoped_pool = p; }
+    ~pool_scope() { scoped_pool = saved; }
+    pool_scope(const pool_scope &) = delete;
+    pool_scope &operator=(const pool_scope &) = delete;
+};
 
-    static void Initialize(const char* pool_name, size_t pool_size){
+    // Pointer into the pool kept as its 8-byte offset from the pool base, so
+    // a pool can be mapped anywhere. Offset 0 is the pool header and stands
+    // for NULL. Converting is one add against the base of the current pool,
+    // held in DRAM, without the 16-byte PMEMoid and the lookup behind
+    // pmemobj_direct; a pptr only ever points within its own pool.
+template <class X>
+class pptr{
+    uint64_t off;
+
+    static char *base();
+
+public:
+    pptr() = default; // leaves a reattached object's offset alone
+    pptr(X *p) : off(p ? (uint64_t)((char *)p - base()) : 0) {}
+
+    static pptr from_raw(uint64_t raw) {
+        pptr p;
+        p.off = raw;
+        return p;
+    }
+    uint64_t raw() const { return off; }
+
+    X *get() const { return off ? (X *)(base() + off) : nullptr; }
+    operator X *() const { return get(); }
+    X *operator->() const { return get(); }
+};
+
+struct SlabChunk;
+
+    // Pool-wide persistent state, kept in the PMDK root object
+struct PoolRoot{
+    uint64_t generation; // bumped on every create or open of the pool
+    pptr<void> tree;     // tree to reattach when the pool is reopened
+    uint64_t tree_tag;   // how that tree was built, up to its user
+    pptr<SlabChunk> slabs; // every PageSlab chunk, newest first
+    PMEMoid slab_new;    // a chunk allocated but maybe not yet linked
+    PMEMoid trees;       // first TreeDirBlock of the named trees
+};
+
+// longest tree name, with its terminating NUL
+#ifndef TREE_NAME_MAX
+#define TREE_NAME_MAX 48
+#endif
+
+// open pools a process can have at a time
+#ifndef POOL_MAX
+#define POOL_MAX 64
+#endif
+
+    // A named tree in the pool directory. The entry is taken while tree is
+    // set, which is written after the rest and cleared first.
+struct TreeDirEntry{
+    char name[TREE_NAME_MAX];
+    uint64_t tag;    // how the tree was built, up to its user
+    pptr<void> tree;
+};
+
+#define TREE_DIR_ENTRIES 63
+
+    // Directory blocks are chained from PoolRoot::trees, each allocated
+    // straight into the link before it, so a crash can not lose one
+struct TreeDirBlock{
+    PMEMoid next;
+    TreeDirEntry entries[TREE_DIR_ENTRIES];
+};
+
+    // Head of a pool chunk of equal-sized slots. Bit i of used is set while
+    // slot i is handed out. The bitmap is the only record of that, so it is
+    // written back before a slot is used and after one is given back.
+struct SlabChunk{
+    uint64_t slot_size;  // bytes per slot, a multiple of NODE_ALIGN
+    uint64_t num_slots;
+    uint64_t first_slot; // offset of slot 0, on a NODE_ALIGN boundary
+    pptr<SlabChunk> next;
+    uint64_t used[1];    // (num_slots + 63) / 64 words
+
+    char *slot(uint64_t i) { return (char *)this + first_slot + i * slot_size; }
+};
+
+    // DRAM side of a chunk of an open pool. It outlives the pool, as threads
+    // may still name it as theirs; pool_serial tells it is stale.
+struct SlabCursor{
+    SlabChunk *head;
+    uint64_t pool_serial;
+    std::atomic<bool> owned;
+    std::atomic<int64_t> free_slots;
+    uint64_t hint; // bitmap word the owner looks at first
+};
+
+    // The chunks of every open pool, by address, and the lock they are
+    // linked, taken and given back under
+struct SlabRegistry{
+    static std::mutex mtx;
+    static std::map<char *, SlabCursor *> chunks;
+
+    static uint64_t Words(uint64_t num_slots) { return (num_slots + 63) / 64; }
+
+    static SlabCursor *Register(SlabChunk *h, uint64_t serial){
+        uint64_t used = 0;
+        for (uint64_t w = 0; w < Words(h->num_slots); ++w) {
+            used += __builtin_popcountll(h->used[w]);
+        }
+        SlabCursor *c = new SlabCursor;
+        c->head = h;
+        c->pool_serial = serial;
+        c->owned = false;
+        c->free_slots = h->num_slots - used;
+        c->hint = 0;
+        chunks[(char *)h] = c;
+        return c;
+    }
+};
+
+std::mutex SlabRegistry::mtx;
+std::map<char *, SlabCursor *> SlabRegistry::chunks;
+
+    // An open pool. Each tree keeps the handle of the pool it lives in, and
+    // any number of trees can share one, found by name in the pool
+    // directory. Opening creates the file if there is none; closing, by
+    // deleting the handle, must wait until no thread is in its trees.
+class PMPool{
+public:
+    PMEMobjpool *pm_pool_;
+    uint32_t generation;
+    pool_options options;
+    int id;          // slot in open_pools, which per-thread state is kept by
+    uint64_t serial; // unique in the process, unlike id
+
+    static std::mutex open_mtx;
+    static PMPool *open_pools[POOL_MAX];
+    static uint64_t last_serial;
+
+    explicit PMPool(const pool_options &opt) : options(opt) {
+        const char *pool_name = opt.path.c_str();
+#ifndef PMDK_CREATE_ADDR
+        if (opt.addr != 0) {
+            LOG("pool address ignored, set PMEM_MMAP_HINT to choose it");
+        }
+#endif
         if (!FileExists(pool_name)) {
             LOG("creating a new pool");
-            //pm_pool_ = pmemobj_create_addr(pool_name, layout_name, pool_size,
-            //                                CREATE_MODE_RW, (void*)pool_addr);
-            pm_pool_ = pmemobj_create(pool_name, layout_name, pool_size,
+#ifdef PMDK_CREATE_ADDR
+            if (opt.addr != 0) {
+                pm_pool_ = pmemobj_create_addr(pool_name, layout_name, opt.size,
+                                               CREATE_MODE_RW, (void*)opt.addr);
+            } else
+#endif
+            pm_pool_ = pmemobj_create(pool_name, layout_name, opt.size,
                                             CREATE_MODE_RW);
             if (pm_pool_ == nullptr) {
                 LOG_FATAL("failed to create a pool;");
@@ -52,7 +237,12 @@ public:
         }else{
             LOG("opening an existing pool, and trying to map to same address");
             /* Need to open an existing persistent pool */
-            //pm_pool_ = pmemobj_open_addr(pool_name, layout_name, (void*)pool_addr);
+#ifdef PMDK_CREATE_ADDR
+            if (opt.addr != 0) {
+                pm_pool_ = pmemobj_open_addr(pool_name, layout_name,
+                                             (void*)opt.addr);
+            } else
+#endif
             pm_pool_ = pmemobj_open(pool_name, layout_name);
             if (pm_pool_ == nullptr) {
                 LOG_FATAL("failed to open the pool");
@@ -60,60 +250,94 @@ public:
             std::cout << "pool opened at: " << std::hex << pm_pool_
                 << std::dec << std::endl;
         }
+
+        {
+            std::lock_guard<std::mutex> lock(open_mtx);
+            for (id = 0; id < POOL_MAX && open_pools[id] != nullptr; ++id)
+                ;
+            if (id == POOL_MAX) {
+                LOG_FATAL("too many open pools");
+            }
+            open_pools[id] = this;
+            serial = ++last_serial;
+        }
+
+        // node locks taken before this open are recognised by their
+        // generation and treated as free
+        pool_scope scope(this);
+        PoolRoot *root = (PoolRoot *)GetRoot(sizeof(PoolRoot));
+        root->generation++;
+        Persist(root, sizeof(PoolRoot));
+        generation = (uint32_t)root->generation;
+        LoadSlabs(root);
     }
 
-    static void ClosePool(const char* pool_name){
-        std::cout << "remove the memory pool" << std::endl;
-        if(pm_pool_ != nullptr){
+    ~PMPool(){
+        {
+            std::lock_guard<std::mutex> lock(SlabRegistry::mtx);
+            for (auto it = SlabRegistry::chunks.begin();
+                 it != SlabRegistry::chunks.end();) {
+                if (it->second->pool_serial == serial) {
+                    it = SlabRegistry::chunks.erase(it);
+                } else {
+                    ++it;
+                }
+            }
+        }
+        {
+            std::lock_guard<std::mutex> lock(open_mtx);
+            open_pools[id] = nullptr;
+        }
         pmemobj_close(pm_pool_);
-        pm_pool_ = nullptr;
-        //FIXME: should not delete the memory pool, but for easy test, I add this
-        remove(pool_name);        
+        if (!options.keep) {
+            std::cout << "remove the memory pool" << std::endl;
+            remove(options.path.c_str());
         }
     }
 
-    static void* GetRoot(size_t size) {
+    void* GetRoot(size_t size) {
         return pmemobj_direct(pmemobj_root(pm_pool_, size));
     }
 
-
-    static void Allocate(void** ptr, size_t size){
+    // Allocate size bytes starting on an align boundary, a power of two of
+    // at least 16. PMDK puts an object 16 bytes past a cache line, so align
+    // more bytes are taken and the distance back to the object is kept in
+    // the 8 bytes before the returned address, where Free finds it.
+    void AlignedAllocate(void** ptr, size_t size, size_t align, bool zero){
         PMEMoid tmp_ptr;
-        auto ret = pmemobj_alloc(pm_pool_, &tmp_ptr, size + 64, TOID_TYPE_NUM(char), NULL, NULL);
+        auto ret = zero ? pmemobj_zalloc(pm_pool_, &tmp_ptr, size + align,
+                                         TOID_TYPE_NUM(char))
+                        : pmemobj_alloc(pm_pool_, &tmp_ptr, size + align,
+                                        TOID_TYPE_NUM(char), NULL, NULL);
         if (ret) {
           std::cout << "Fail logging: " << ret << "; Size = " << size << std::endl;
           LOG_FATAL("Allocate: Allocation Error in PMEMoid 1");
         }
-        //*ptr = pmemobj_direct(tmp_ptr);
-        uint64_t ptr_value = (uint64_t)(pmemobj_direct(tmp_ptr)) + 48;
+        uint64_t base = (uint64_t)pmemobj_direct(tmp_ptr);
+        uint64_t ptr_value =
+            (base + sizeof(uint64_t) + align - 1) & ~(uint64_t)(align - 1);
+        ((uint64_t *)ptr_value)[-1] = ptr_value - base;
+        Persist(&((uint64_t *)ptr_value)[-1], sizeof(uint64_t));
         *ptr = (void*)(ptr_value);
-        //collect_allocated++;
     }
 
-    static void ZAllocate(void** ptr, size_t size){
-        PMEMoid tmp_ptr;
-        auto ret = pmemobj_zalloc(pm_pool_, &tmp_ptr, size, TOID_TYPE_NUM(char));
-        if (ret) {
-          std::cout << "Fail logging: " << ret << "; Size = " << size << std::endl;
-          LOG_FATAL("Allocate: Allocation Error in PMEMoid 1");
-        }
-        //*ptr = pmemobj_direct(tmp_ptr);
-         uint64_t ptr_value = (uint64_t)(pmemobj_direct(tmp_ptr)) + 48;
-        *ptr = (void*)(ptr_value);
+    void Allocate(void** ptr, size_t size){
+        AlignedAllocate(ptr, size, kCacheLineSize, false);
     }
 
+    void ZAllocate(void** ptr, size_t size){
+        AlignedAllocate(ptr, size, kCacheLineSize, true);
+    }
 
-    static void Allocate(PMEMoid *ptr, size_t size){
+    void Allocate(PMEMoid *ptr, size_t size){
         auto ret = pmemobj_alloc(pm_pool_, ptr, size, TOID_TYPE_NUM(char), NULL, NULL);
-        //auto ret = pmemobj_zalloc(pm_pool_, ptr, size, TOID_TYPE_NUM(char));
         if (ret) {
           std::cout << "Fail logging: " << ret << "; Size = " << size << std::endl;
           LOG_FATAL("Allocate: Allocation Error in PMEMoid 1");
         }
     }
 
-
-    static void ZAllocate(PMEMoid *ptr, size_t size){
+    void ZAllocate(PMEMoid *ptr, size_t size){
         auto ret = pmemobj_zalloc(pm_pool_, ptr, size, TOID_TYPE_NUM(char));
         if (ret) {
           std::cout << "Fail logging: " << ret << "; Size = " << size << std::endl;
@@ -121,23 +345,355 @@ public:
         }
     }
 
-	static void Free(void* p){
-        uint64_t ptr_value = (uint64_t)(p) - 48;
-        p = (void*)(ptr_value); 
+    // Free what AlignedAllocate gave out, in whichever pool it is
+    static void Free(void* p){
+        uint64_t ptr_value = (uint64_t)(p) - ((uint64_t *)p)[-1];
+        p = (void*)(ptr_value);
         auto ptr = pmemobj_oid(p);
         pmemobj_free(&ptr);
     }
 
-    static void Persist(void* p, size_t size){
+    void Persist(void* p, size_t size){
         pmemobj_persist(pm_pool_, p, size);
     }
+
+    // The tree registered as name and its tag, or NULL
+    void *FindTree(const char *name, uint64_t *tag = nullptr){
+        pool_scope scope(this);
+        std::lock_guard<std::mutex> lock(dir_mtx);
+        TreeDirEntry *e = FindEntry(name);
+        if (e == nullptr) {
+            return nullptr;
+        }
+        if (tag != nullptr) {
+            *tag = e->tag;
+        }
+        return e->tree;
+    }
+
+    // Register tree as name; false if the name is taken or too long
+    bool AddTree(const char *name, void *tree, uint64_t tag){
+        if (strlen(name) >= TREE_NAME_MAX) {
+            return false;
+        }
+        pool_scope scope(this);
+        std::lock_guard<std::mutex> lock(dir_mtx);
+        if (FindEntry(name) != nullptr) {
+            return false;
+        }
+
+        TreeDirEntry *e = nullptr;
+        PoolRoot *root = (PoolRoot *)GetRoot(sizeof(PoolRoot));
+        for (PMEMoid *link = &root->trees; e == nullptr;) {
+            if (OID_IS_NULL(*link)) {
+                ZAllocate(link, sizeof(TreeDirBlock));
+            }
+            TreeDirBlock *b = (TreeDirBlock *)pmemobj_direct(*link);
+            for (int i = 0; i < TREE_DIR_ENTRIES && e == nullptr; ++i) {
+                if (b->entries[i].tree.raw() == 0) {
+                    e = &b->entries[i];
+                }
+            }
+            link = &b->next;
+        }
+
+        memset(e->name, 0, TREE_NAME_MAX);
+        strcpy(e->name, name);
+        e->tag = tag;
+        Persist(e, sizeof(TreeDirEntry));
+        e->tree = tree;
+        Persist(&e->tree, sizeof(e->tree));
+        return true;
+    }
+
+    // Take name out of the directory; the tree itself is left alone
+    bool RemoveTree(const char *name){
+        pool_scope scope(this);
+        std::lock_guard<std::mutex> lock(dir_mtx);
+        TreeDirEntry *e = FindEntry(name);
+        if (e == nullptr) {
+            return false;
+        }
+        e->tree = nullptr;
+        Persist(&e->tree, sizeof(e->tree));
+        return true;
+    }
+
+private:
+    std::mutex dir_mtx;
+
+    TreeDirEntry *FindEntry(const char *name){
+        PoolRoot *root = (PoolRoot *)GetRoot(sizeof(PoolRoot));
+        for (TreeDirBlock *b = (TreeDirBlock *)pmemobj_direct(root->trees);
+             b != nullptr; b = (TreeDirBlock *)pmemobj_direct(b->next)) {
+            for (int i = 0; i < TREE_DIR_ENTRIES; ++i) {
+                TreeDirEntry *e = &b->entries[i];
+                if (e->tree.raw() != 0 &&
+                    strncmp(e->name, name, TREE_NAME_MAX) == 0) {
+                    return e;
+                }
+            }
+        }
+        return nullptr;
+    }
+
+    // Register the chunks in the pool. A chunk still in slab_new was either
+    // linked already or never gave out a slot, and is then returned.
+    void LoadSlabs(PoolRoot *root){
+        if (!OID_IS_NULL(root->slab_new)) {
+            if (root->slabs.get() != pmemobj_direct(root->slab_new)) {
+                pmemobj_free(&root->slab_new);
+            } else {
+                root->slab_new = OID_NULL;
+                Persist(&root->slab_new, sizeof(PMEMoid));
+            }
+        }
+        std::lock_guard<std::mutex> lock(SlabRegistry::mtx);
+        for (SlabChunk *h = root->slabs; h != nullptr; h = h->next) {
+            SlabRegistry::Register(h, serial);
+        }
+    }
+};
+
+std::mutex PMPool::open_mtx;
+PMPool *PMPool::open_pools[POOL_MAX];
+uint64_t PMPool::last_serial = 0;
+
+template <class X>
+inline char *pptr<X>::base() { return (char *)CurrentPool()->pm_pool_; }
+
+    // The default pool, opened by Initialize, and the static interface the
+    // single-tree code uses; every call goes to the current pool
+class BasePMPool{
+public:
+    static PMEMoid p_all_tables;
+    static char *all_tables;
+    static uint64_t all_allocated;
+    static uint64_t all_deallocated;
+    static uint64_t collect_allocated;
+
+    static void Initialize(const char* pool_name, size_t pool_size){
+        pool_options opt;
+        opt.path = pool_name;
+        opt.size = pool_size;
+        Initialize(opt);
+    }
+
+    static void Initialize(const pool_options &opt){
+        default_pool = new PMPool(opt);
+    }
+
+    static void ClosePool(){
+        delete default_pool;
+        default_pool = nullptr;
+    }
+
+    static void* GetRoot(size_t size) { return CurrentPool()->GetRoot(size); }
+
+    static void AlignedAllocate(void** ptr, size_t size, size_t align,
+                                bool zero){
+        CurrentPool()->AlignedAllocate(ptr, size, align, zero);
+    }
+
+    static void Allocate(void** ptr, size_t size){
+        CurrentPool()->Allocate(ptr, size);
+    }
+
+    static void ZAllocate(void** ptr, size_t size){
+        CurrentPool()->ZAllocate(ptr, size);
+    }
+
+    static void Allocate(PMEMoid *ptr, size_t size){
+        CurrentPool()->Allocate(ptr, size);
+    }
+
+    static void ZAllocate(PMEMoid *ptr, size_t size){
+        CurrentPool()->ZAllocate(ptr, size);
+    }
+
+	static void Free(void* p){ PMPool::Free(p); }
+
+    static void Persist(void* p, size_t size){
+        CurrentPool()->Persist(p, size);
+    }
 };
 
-	
-PMEMobjpool* BasePMPool::pm_pool_ = nullptr;
 PMEMoid BasePMPool::p_all_tables = OID_NULL;
 char* BasePMPool::all_tables = nullptr;
 uint64_t BasePMPool::all_allocated = 0;
 uint64_t BasePMPool::all_deallocated = 0;
 uint64_t BasePMPool::collect_allocated = 0;
+
+    // Allocator of SIZE-byte tree nodes that keeps libpmemobj off the split
+    // path. A thread takes slots from a chunk of the current pool it owns,
+    // claiming each in the chunk bitmap with one flush; only when the chunk
+    // is full does it take the lock, to move to a chunk with room or link
+    // a new one into the pool. A crash may leak the node being built, as
+    // with pmemobj_zalloc, but never hands a slot out twice. Slots start on
+    // NODE_ALIGN and are not zeroed, nodes are built by their constructors.
+template <size_t SIZE>
+class PageSlab{
+    static constexpr uint64_t kSlotSize =
+        (SIZE + NODE_ALIGN - 1) / NODE_ALIGN * NODE_ALIGN;
+
+    // the chunk a thread allocates from in each pool, given up when the
+    // thread exits
+    struct Owner{
+        SlabCursor *chunk[POOL_MAX] = {};
+        uint64_t *unflushed[POOL_MAX] = {}; // bitmap word left to Sync()
+        ~Owner(){
+            for (int i = 0; i < POOL_MAX; ++i) {
+                if (chunk[i]) {
+                    chunk[i]->owned = false;
+                }
+            }
+        }
+    };
+
+    static thread_local Owner mine;
+
+    static uint64_t Words(uint64_t num_slots) { return (num_slots + 63) / 64; }
+
+    // Claim a free slot of c, NULL if there is none. The bitmap word is
+    // made durable at once, or with unflushed set only written back, and
+    // only when it is not the word *unflushed names already.
+    static char *Take(SlabCursor *c, uint64_t **unflushed){
+        SlabChunk *h = c->head;
+        uint64_t words = Words(h->num_slots);
+        for (uint64_t n = 0; n < words; ++n) {
+            uint64_t w = (c->hint + n) % words;
+            uint64_t free_bits = ~LOAD(&h->used[w]);
+            uint64_t i = w * 64 + (free_bits ? __builtin_ctzll(free_bits) : 64);
+            if (!free_bits || i >= h->num_slots) {
+                continue;
+            }
+            // only the owner sets bits, frees clear them concurrently
+            __atomic_fetch_or(&h->used[w], 1ULL << (i % 64), __ATOMIC_SEQ_CST);
+            if (unflushed == nullptr) {
+                clflush((char *)&h->used[w], sizeof(uint64_t));
+            } else if (*unflushed != &h->used[w]) {
+                if (*unflushed != nullptr) {
+                    flush_lines(*unflushed, sizeof(uint64_t));
+                }
+                *unflushed = &h->used[w];
+            }
+            c->hint = w;
+            --c->free_slots;
+            return h->slot(i);
+        }
+        return nullptr;
+    }
+
+    // Carve a new chunk out of the pool. It is allocated straight into
+    // slab_new, so a crash can not lose it, and linked before any of its
+    // slots is used.
+    static SlabCursor *Link(PMPool *pool, PoolRoot *root){
+        if (pmemobj_zalloc(pool->pm_pool_, &root->slab_new,
+                           SLAB_CHUNK_SIZE, TOID_TYPE_NUM(char))) {
+            LOG_FATAL("PageSlab: Allocation Error in PMEMoid");
+        }
+        SlabChunk *h = (SlabChunk *)pmemobj_direct(root->slab_new);
+        uint64_t num_slots = SLAB_CHUNK_SIZE / kSlotSize, first;
+        for (;; --num_slots) {
+            uint64_t end = (uint64_t)&h->used[Words(num_slots)];
+            first = (end + NODE_ALIGN - 1) / NODE_ALIGN * NODE_ALIGN -
+                    (uint64_t)h;
+            if (first + num_slots * kSlotSize <= SLAB_CHUNK_SIZE) {
+                break;
+            }
+        }
+        h->slot_size = kSlotSize;
+        h->num_slots = num_slots;
+        h->first_slot = first;
+        h->next = root->slabs;
+        pool->Persist(h, sizeof(SlabChunk)); // the bitmap is zeroed
+
+        root->slabs = h;
+        pool->Persist(&root->slabs, sizeof(root->slabs));
+        root->slab_new = OID_NULL;
+        pool->Persist(&root->slab_new, sizeof(PMEMoid));
+        return SlabRegistry::Register(h, pool->serial);
+    }
+
+    // A chunk of this size in pool with room that no thread owns, or a new
+    // one. A chunk is only reused if its slots are on NODE_ALIGN.
+    static SlabCursor *Acquire(PMPool *pool){
+        pool_scope scope(pool);
+        std::lock_guard<std::mutex> lock(SlabRegistry::mtx);
+        for (auto &e : SlabRegistry::chunks) {
+            SlabCursor *c = e.second;
+            if (c->pool_serial == pool->serial &&
+                c->head->slot_size == kSlotSize &&
+                (uint64_t)c->head->slot(0) % NODE_ALIGN == 0 &&
+                c->free_slots > 0 && !c->owned) {
+                c->owned = true;
+                return c;
+            }
+        }
+        SlabCursor *c = Link(pool, (PoolRoot *)pool->GetRoot(sizeof(PoolRoot)));
+        c->owned = true;
+        return c;
+    }
+
+public:
+    // With deferred set, the claim is not fenced, and the last bitmap word
+    // is not even written back, until Sync(); a builder that fences once
+    // before publishing its nodes takes them this way.
+    static void Allocate(void** ptr, bool deferred = false){
+        PMPool *pool = CurrentPool();
+        SlabCursor *&c = mine.chunk[pool->id];
+        uint64_t **unflushed = deferred ? &mine.unflushed[pool->id] : nullptr;
+        char *p;
+        while (c == nullptr || c->pool_serial != pool->serial ||
+               (p = Take(c, unflushed)) == nullptr) {
+            if (c != nullptr) {
+                c->owned = false;
+            }
+            c = Acquire(pool);
+        }
+        *ptr = p;
+    }
+
+    // Give back a slot of the pool with the given serial. A node an older
+    // pool got from ZAllocate, or one of a pool closed since, is left where
+    // it is: another pool may have been mapped over it meanwhile, so the
+    // chunk at its address is only trusted if it is still that pool's.
+    static void Free(void* p, uint64_t pool_serial){
+        SlabCursor *c;
+        {
+            std::lock_guard<std::mutex> lock(SlabRegistry::mtx);
+            auto it = SlabRegistry::chunks.upper_bound((char *)p);
+            if (it == SlabRegistry::chunks.begin()) {
+                return;
+            }
+            c = std::prev(it)->second;
+        }
+        SlabChunk *h = c->head;
+        if (c->pool_serial != pool_serial ||
+            (char *)p >= (char *)h + SLAB_CHUNK_SIZE) {
+            return;
+        }
+        uint64_t i = ((char *)p - h->slot(0)) / h->slot_size;
+        __atomic_fetch_and(&h->used[i / 64], ~(1ULL << (i % 64)),
+                           __ATOMIC_SEQ_CST);
+        clflush((char *)&h->used[i / 64], sizeof(uint64_t));
+        ++c->free_slots;
+    }
+
+    // Give back a slot of the current pool
+    static void Free(void* p){ Free(p, CurrentPool()->serial); }
+
+    // Write back the bitmap word the thread's deferred claims in the
+    // current pool left, to be fenced by the caller
+    static void Sync(){
+        uint64_t *&w = mine.unflushed[CurrentPool()->id];
+        if (w != nullptr) {
+            flush_lines(w, sizeof(uint64_t));
+            w = nullptr;
+        }
+    }
+};
+
+template <size_t SIZE>
+thread_local typename PageSlab<SIZE>::Owner PageSlab<SIZE>::mine;
 }
\ No newline at end of file
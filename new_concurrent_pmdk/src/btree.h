@@ -11,9 +11,11 @@
    Please use at your own risk.
 */
 
+#include <algorithm>
 #include <cassert>
 #include <climits>
 #include <fstream>
+#include <functional>
 #include <future>
 #include <iostream>
 #include <math.h>
@@ -23,111 +25,206 @@
 #include <stdlib.h>
 #include <string.h>
 #include <time.h>
+#include <thread>
+#include <type_traits>
 #include <unistd.h>
 #include <vector>
+#include "persist.h"
+#include "epoch.h"
 #include "allocator.h"
 #include "tree.h"
 
 #define PAGESIZE 512
 
-#define CPU_FREQ_MHZ (1994)
 #define DELAY_IN_NS (1000)
 #define CACHE_LINE_SIZE 64
 #define QUERY_NUM 25
 
 #define IS_FORWARD(c) (c % 2 == 0)
 
-using entry_key_t = int64_t;
-pthread_mutex_t print_mtx;
+// internal nodes with at least this many entries are searched by bisection
+#ifndef BSEARCH_MIN_ENTRIES
+#define BSEARCH_MIN_ENTRIES 64
+#endif
 
-static inline void cpu_pause() { __asm__ volatile("pause" ::: "memory"); }
-static inline unsigned long read_tsc(void) {
-  unsigned long var;
-  unsigned int hi, lo;
+// lookups multi_get() walks down the tree side by side
+#ifndef MULTI_GET_GROUP
+#define MULTI_GET_GROUP 16
+#endif
 
-  asm volatile("rdtsc" : "=a"(lo), "=d"(hi));
-  var = ((unsigned long long int)hi << 32) | lo;
+// share of a node's slots bulk_load() fills, leaving room for inserts
+#ifndef BULK_LOAD_FILL
+#define BULK_LOAD_FILL 0.7
+#endif
 
-  return var;
-}
+// a leaf a delete leaves with fewer than this share of its slots in use is
+// merged with a neighbour, if the two fit in 1 - MERGE_FILL of a node;
+// 0 turns merging off
+#ifndef MERGE_FILL
+#define MERGE_FILL 0.25
+#endif
+
+// With HYBRID_INDEX only the leaves, linked by their siblings, are kept in
+// the pool. Internal nodes live in DRAM and are rebuilt from the leaf chain
+// when a tree is reopened.
+
+
+using entry_key_t = int64_t;
+pthread_mutex_t print_mtx;
 
-unsigned long write_latency_in_ns = 0;
 unsigned long long search_time_in_insert = 0;
 unsigned int gettime_cnt = 0;
 unsigned long long clflush_time_in_insert = 0;
 unsigned long long update_time_in_insert = 0;
-int clflush_cnt = 0;
 int node_cnt = 0;
 
 using namespace std;
 
-inline void mfence() { asm volatile("mfence" ::: "memory"); }
+template <class T, class P, int PS>
+class page;
 
-inline void clflush(char *data, int len) {
-  volatile char *ptr = (char *)((unsigned long)data & ~(CACHE_LINE_SIZE - 1));
-  mfence();
-  for (; ptr < data + len; ptr += CACHE_LINE_SIZE) {
-    unsigned long etsc =
-        read_tsc() + (unsigned long)(write_latency_in_ns * CPU_FREQ_MHZ / 1000);
-    asm volatile("clflush %0" : "+m"(*(volatile char *)ptr));
-    while (read_tsc() < etsc)
-      cpu_pause();
-  }
-  mfence();
-}
+template <class T, class P, int PS>
+class range_iterator;
 
-template <class T, class P>
-class page;
+template <class T, class P, int PS>
+class reverse_range_iterator;
 
-template <class T, class P>
+// The test driver leaves nodes as a crash would through it
+struct crash_test;
+
+template <class T, class P, int PS = PAGESIZE>
 class btree : public Tree<T, P>{
 private:
   int height;
-  char *root;
+  my_alloc::pptr<page<T, P, PS>> root;
+#ifdef HYBRID_INDEX
+  my_alloc::pptr<page<T, P, PS>> first_leaf; // where the leaf chain starts
+#endif
+  my_alloc::PMPool *pool; // handle of the pool the tree is in, set on open
   typedef std::pair<T, P> V;
+
+  struct reopen_tag {};
+  btree(reopen_tag) {} // keeps the persistent fields, resets the vtable
+  void recover();
+#ifdef HYBRID_INDEX
+  void rebuild(int n_threads);
+#endif
+  void build_level(int n_nodes,
+                   const std::function<page<T, P, PS> *(int)> &make,
+                   std::vector<page<T, P, PS> *> &nodes,
+                   std::vector<T> &low_keys, int n_threads);
+  page<T, P, PS> *build_index(std::vector<page<T, P, PS> *> &nodes,
+                              std::vector<T> &low_keys, int per_node,
+                              int n_threads, uint32_t *level);
 public:
   btree();
+  static btree *reopen(void *); // reattach a tree left in the pool
+  static btree *create(my_alloc::PMPool *, const char *name);
+  static btree *open(my_alloc::PMPool *, const char *name);
   void setNewRoot(char *); // parameter is pointer to new root
   void getNumberOfNodes();
   bool insert(const T&, const P&);
+  void insert_batch(const V[], int);
+  bool update(const T&, const P&);
+  void upsert(const T&, const P&);
   void btree_insert_internal(char *, T, P, uint32_t);
   void btree_delete(T);
   void btree_delete_internal(T, P, uint32_t, T *,
-                             bool *, page<T, P> **);
+                             bool *, page<T, P, PS> **);
+  void merge_leaves(T);
   P search(const T&) const;
+  void multi_get(const T *, P *, int) const;
   void bulk_load(const V[], int);
+  void bulk_load(const V[], int, double fill, int n_threads = 0);
   void btree_search_range(T, T, unsigned long *);
+  range_iterator<T, P, PS> lower_bound(const T &, bool inclusive = true);
+  reverse_range_iterator<T, P, PS> reverse_from(const T &,
+                                                bool inclusive = true);
   void printAll();
 
-  friend class page<T, P>;
+  friend class page<T, P, PS>;
+  friend struct crash_test;
+};
+
+// Writer lock and version counter in one word inside the node. The low 32
+// bits are the version, odd while a writer holds the lock; the high 32 bits
+// are the pool generation the lock was last taken in. A word from an older
+// generation belongs to a process that is gone and counts as unlocked, so
+// locks need no pass over the tree after a restart.
+class version_lock {
+private:
+  uint64_t word;
+
+  static uint64_t generation() {
+    return (uint64_t)my_alloc::CurrentPool()->generation << 32;
+  }
+
+public:
+  version_lock() : word(generation()) {}
+
+  // Returns true if this is the first time the lock is taken since the pool
+  // was opened, i.e. the node may still carry the effects of a crash
+  bool lock() {
+    uint64_t gen = generation();
+    uint64_t old = LOAD(&word);
+    while (true) {
+      uint32_t version = (uint32_t)old;
+      bool stale = (old & ~0xffffffffULL) != gen;
+      if (stale) {
+        version &= ~1u; // left held by an earlier generation
+      } else if (version & 1) {
+        cpu_pause();
+        old = LOAD(&word);
+        continue;
+      }
+      if (CAS(&word, &old, gen | (uint32_t)(version + 1))) {
+        return stale;
+      }
+    }
+  }
+
+  void unlock() {
+    STORE(&word, (word & ~0xffffffffULL) | (uint32_t)(word + 1));
+  }
+
+  // Whether the lock has been taken since the pool was opened, by a writer
+  // that repaired the node first
+  bool current() { return (LOAD(&word) & ~0xffffffffULL) == generation(); }
+
+  // Readers compare versions taken before and after a lookup; an odd value
+  // means a writer was active. A lock left over from an earlier generation
+  // has no writer behind it.
+  uint32_t version() {
+    uint64_t w = LOAD(&word);
+    uint32_t version = (uint32_t)w;
+    return ((w & ~0xffffffffULL) == generation()) ? version : version & ~1u;
+  }
 };
 
-template<class T, class P>
+template <class T, class P, int PS>
 class header {
 private:
-  page<T, P> *leftmost_ptr;     // 8 bytes
-  page<T, P> *sibling_ptr;      // 8 bytes
+  my_alloc::pptr<page<T, P, PS>> leftmost_ptr; // 8 bytes
+  my_alloc::pptr<page<T, P, PS>> sibling_ptr;  // 8 bytes
   uint32_t level;         // 4 bytes
   uint8_t switch_counter; // 1 bytes
   uint8_t is_deleted;     // 1 bytes
   int16_t last_index;     // 2 bytes
-  std::mutex *mtx;        // 8 bytes
+  version_lock latch;     // 8 bytes
 
-  friend class page<T, P>;
-  friend class btree<T, P>;
+  friend class page<T, P, PS>;
+  friend class btree<T, P, PS>;
+  friend class reverse_range_iterator<T, P, PS>;
+  friend struct crash_test;
 
 public:
   header() {
-    mtx = new std::mutex();
-
     leftmost_ptr = NULL;
     sibling_ptr = NULL;
     switch_counter = 0;
     last_index = -1;
     is_deleted = false;
   }
-
-  ~header() { delete mtx; }
 };
 
 template <class T, class P>
@@ -142,32 +239,84 @@ public:
     ptr = NULL;
   }
 
-  friend class page<T, P>;
-  friend class btree<T, P>;
+  template <class, class, int> friend class page;
+  template <class, class, int> friend class btree;
+  friend struct crash_test;
 };
 
-const int cardinality = (PAGESIZE - sizeof(header<entry_key_t, char*>)) / sizeof(entry<entry_key_t, char*>);
+#ifdef SOA_LAYOUT
+// Structure-of-arrays slots: keys are packed contiguously so a key scan does
+// not drag pointer bytes through the cache, and the pointers live in a
+// parallel array. records[i] yields a pair of references, so records[i].key
+// and records[i].ptr read the same as with the interleaved entry<T, P> array.
+template <class T, class P, int N>
+class split_records {
+public:
+  T keys[N]; // 8 bytes * n
+  P ptrs[N]; // 8 bytes * n
+
+  struct slot {
+    T &key;
+    P &ptr;
+  };
+
+  split_records() {
+    for (int i = 0; i < N; ++i) {
+      keys[i] = LONG_MAX;
+      ptrs[i] = NULL;
+    }
+  }
 
-template<class T, class P>
+  inline slot operator[](int i) { return slot{keys[i], ptrs[i]}; }
+};
+#endif
+
+// PS is the node size in bytes; the slot count is derived per instantiation
+template <class T, class P, int PS>
 class page {
+public:
+#ifdef FINGERPRINT
+  // one-byte key hashes right after the header, sized for the slots that
+  // would fit without them and rounded up to whole 32-byte SIMD_CMP8 blocks
+  static constexpr int fingerprint_bytes =
+      ((PS - sizeof(header<T, P, PS>)) / sizeof(entry<T, P>) + 31) / 32 * 32;
+  static constexpr int fingerprint_blocks = fingerprint_bytes / 32;
+#else
+  static constexpr int fingerprint_bytes = 0;
+#endif
+  static constexpr int cardinality =
+      (PS - sizeof(header<T, P, PS>) - fingerprint_bytes) / sizeof(entry<T, P>);
+
 private:
-  header<T, P> hdr;                 // header in persistent memory, 16 bytes
+  header<T, P, PS> hdr;                 // header in persistent memory, 16 bytes
+#ifdef FINGERPRINT
+  uint8_t fingerprints[fingerprint_bytes]; // shares the first line with hdr
+#endif
+#ifdef SOA_LAYOUT
+  split_records<T, P, cardinality> records; // keys[n] followed by ptrs[n]
+#else
   entry<T, P> records[cardinality]; // slots in persistent memory, 16 bytes * n
+#endif
 
 public:
-  friend class btree<T, P>;
+  friend class btree<T, P, PS>;
+  friend class reverse_range_iterator<T, P, PS>;
+  friend struct crash_test;
 
   page(uint32_t level = 0) {
     hdr.level = level;
     records[0].ptr = NULL;
+#ifdef FINGERPRINT
+    memset(fingerprints, 0, fingerprint_bytes);
+#endif
   }
 
   // this is called when tree grows
-  page(page<T, P> *left, T key, page<T, P> *right, uint32_t level = 0) {
+  page(page<T, P, PS> *left, T key, page<T, P, PS> *right, uint32_t level = 0) {
     hdr.leftmost_ptr = left;
     hdr.level = level;
     records[0].key = key;
-    records[0].ptr = (P)right;
+    records[0].ptr = child_slot(right);
     records[1].ptr = NULL;
 
     hdr.last_index = 0;
@@ -175,6 +324,72 @@ public:
     clflush((char *)this, sizeof(page));
   }
 
+  // Fill a fresh node with n ascending entries for bulk_load(); entry(i)
+  // gives the i-th. An internal node takes left as its leftmost child. The
+  // node is not written back here.
+  template <class E>
+  void bulk_fill(page<T, P, PS> *left, int n, E entry) {
+    hdr.leftmost_ptr = left;
+    for (int i = 0; i < n; ++i) {
+      std::pair<T, P> e = entry(i);
+      records[i].key = e.first;
+      records[i].ptr = e.second;
+    }
+    records[n].ptr = NULL;
+    hdr.last_index = n - 1;
+#ifdef FINGERPRINT
+    update_fingerprints(n, true, false);
+#endif
+  }
+
+  // Start loading the node ahead of a search of it: its first lines, where
+  // the header, the fingerprints and the low slots are; a longer scan is
+  // picked up by the hardware prefetcher
+  inline void prefetch() {
+    for (int i = 0; i < std::min(PS, 8 * CACHE_LINE_SIZE); i += CACHE_LINE_SIZE) {
+      __builtin_prefetch((char *)this + i);
+    }
+  }
+
+  // Internal slots hold their child pool-relative, encoded like
+  // hdr.leftmost_ptr, so the duplicate-pointer test compares like with like.
+  // Leaf slots hold the caller's values as given.
+  static inline P child_slot(page<T, P, PS> *child) {
+    return (P)my_alloc::pptr<page<T, P, PS>>(child).raw();
+  }
+
+  static inline page<T, P, PS> *slot_child(P slot) {
+    return my_alloc::pptr<page<T, P, PS>>::from_raw((uint64_t)slot);
+  }
+
+  // hdr.leftmost_ptr in slot encoding: the left neighbour of slot 0
+  inline P leftmost_slot() { return (P)hdr.leftmost_ptr.raw(); }
+
+  // Whether nodes of the level are kept in the pool. DRAM nodes are linked
+  // the same way, by their distance from the pool base.
+  static inline bool in_pool(uint32_t level) {
+#ifdef HYBRID_INDEX
+    return level == 0;
+#else
+    (void)level;
+    return true;
+#endif
+  }
+
+  // Memory for a node of the given level, to be built by a constructor.
+  // A deferred slot claim has to be completed by PageSlab::Sync() and a
+  // fence before the node can be reached.
+  static page<T, P, PS> *allocate(uint32_t level, bool deferred = false) {
+    page<T, P, PS> *p;
+    if (in_pool(level)) {
+      my_alloc::PageSlab<sizeof(page)>::Allocate((void **)&p, deferred);
+    } else if (posix_memalign((void **)&p, NODE_ALIGN, sizeof(page)) != 0) {
+      fprintf(stderr, "out of memory for an internal node\n");
+      abort();
+    }
+    return p;
+  }
+
   // BT: DRAM allocation
   /*
   void *operator new(size_t size) {
@@ -183,6 +398,138 @@ public:
     return ret;
   }*/
 
+  // In the split layout a slot's key and pointer live in different cache
+  // lines, and lines are not written back in program order. A shift leaves
+  // a slot repeating a neighbour between its two stores, so each store has
+  // to be durable before the next one: a crash in between would otherwise
+  // pair a key with the wrong pointer, and repair() would drop the real
+  // entry as the duplicate. Every key and pointer store of a shift is then
+  // flushed and fenced on its own, which costs the split layout two fences
+  // per shifted slot. In the interleaved layout both share a line, stores
+  // to one line become durable in order, and these do nothing.
+
+  // Make the key of slot i durable before the next store of a shift
+  inline void commit_key(int i) {
+#ifdef SOA_LAYOUT
+    clflush((char *)&records.keys[i], sizeof(T));
+#else
+    (void)i;
+#endif
+  }
+
+  // Make the pointer of slot i durable before the next store of a shift
+  inline void commit_ptr(int i) {
+#ifdef SOA_LAYOUT
+    clflush((char *)&records.ptrs[i], sizeof(P));
+#else
+    (void)i;
+#endif
+  }
+
+  // Flush slot i after it has been written. With the split layout only the
+  // pointer is flushed here; the key was committed before it was stored.
+  inline void flush_slot(int i) {
+#ifdef SOA_LAYOUT
+    clflush((char *)&records.ptrs[i], sizeof(P));
+#else
+    clflush((char *)&records[i], sizeof(entry<T, P>));
+#endif
+  }
+
+  // Keep the stores of a FAST shift in the order readers rely on. The
+  // flushes in between also keep the compiler from merging or reordering
+  // them, but those are conditional, deferred with pending, or skipped.
+  static inline void order_stores() { asm volatile("" ::: "memory"); }
+
+  // Flush slot i during a FAST shift if it begins a new cache line. The
+  // split layout has committed both halves already.
+  inline void flush_shift(int i) {
+#ifdef SOA_LAYOUT
+    (void)i;
+#else
+    uint64_t records_ptr = (uint64_t)(&records[i]);
+    int remainder = records_ptr % CACHE_LINE_SIZE;
+    bool do_flush =
+        (remainder == 0) ||
+        ((((int)(remainder + sizeof(entry<T, P>)) / CACHE_LINE_SIZE) == 1) &&
+         ((remainder + sizeof(entry<T, P>)) % CACHE_LINE_SIZE) != 0);
+    if (do_flush) {
+      clflush((char *)records_ptr, CACHE_LINE_SIZE);
+    }
+#endif
+  }
+
+#ifdef FINGERPRINT
+  // Never 0, so cleared slots can not match
+  static inline uint8_t fingerprint(T key) {
+    uint64_t h = (uint64_t)std::hash<T>()(key) * 0x9E3779B97F4A7C15ULL;
+    uint8_t fp = (uint8_t)(h >> 56);
+    return fp ? fp : 1;
+  }
+
+  // Rewrite the leaf fingerprints from the keys after a FAST shift; slots
+  // from num_entries on are cleared. The stores run in the same direction
+  // as the shift, so a reader always sees a moved key's fingerprint either
+  // at its new slot or at the neighbour it came from.
+  inline void update_fingerprints(int num_entries, bool forward, bool flush) {
+    if (hdr.leftmost_ptr != NULL) {
+      return;
+    }
+
+    volatile uint8_t *fp = fingerprints;
+    if (forward) {
+      for (int i = 0; i < fingerprint_bytes; ++i) {
+        fp[i] = (i < num_entries) ? fingerprint(records[i].key) : 0;
+      }
+    } else {
+      for (int i = fingerprint_bytes - 1; i >= 0; --i) {
+        fp[i] = (i < num_entries) ? fingerprint(records[i].key) : 0;
+      }
+    }
+
+    // The fingerprints are hints that repair() rebuilds, and readers do not
+    // use them in a leaf it has not been run on since the pool was opened,
+    // so they need no fence of their own and ride on the next one
+    if (flush) {
+      flush_lines(fingerprints, fingerprint_bytes);
+    }
+  }
+
+  // Slots whose fingerprint matches, one 32-slot mask per block, widened by
+  // one slot on either side to cover a key that a FAST shift (in flight, or
+  // cut short by a crash) has moved before the fingerprints were rewritten.
+  // The array is read in 16-byte halves, which never straddle a cache line
+  // and so are single loads, in order against the direction of the rewrite;
+  // a key moving across a half is then seen at its old or its new slot.
+  inline void fingerprint_candidates(T key, bool forward, uint32_t *candidates) {
+    uint8_t fp = fingerprint(key);
+    uint32_t hits[fingerprint_blocks] = {};
+    for (int n = 0; n < fingerprint_blocks * 2; ++n) {
+      int h = forward ? n : fingerprint_blocks * 2 - 1 - n;
+      int mask;
+      SSE_CMP8(fingerprints + h * 16, fp);
+      hits[h / 2] |= (uint32_t)mask << (h % 2 * 16);
+      asm volatile("" ::: "memory"); // keep the halves in order
+    }
+
+    for (int b = 0; b < fingerprint_blocks; ++b) {
+      uint32_t hit = hits[b];
+      candidates[b] = hit | (hit << 1) | (hit >> 1);
+      if (b > 0) {
+        candidates[b] |= hits[b - 1] >> 31;
+      }
+      if (b + 1 < fingerprint_blocks) {
+        candidates[b] |= hits[b + 1] << 31;
+      }
+    }
+
+    int tail = cardinality - (fingerprint_blocks - 1) * 32;
+    if (tail < 32) {
+      candidates[fingerprint_blocks - 1] &= (1u << tail) - 1;
+    }
+  }
+#endif
+
   inline int count() {
     uint8_t previous_switch_counter;
     int count = 0;
@@ -209,50 +556,178 @@ public:
     return count;
   }
 
-  inline bool remove_key(T key) {
+  // Remove key by a FAST shift; flush is false for a DRAM node, as in
+  // insert_key()
+  inline bool remove_key(T key, bool flush = true) {
     // Set the switch_counter
     if (IS_FORWARD(hdr.switch_counter))
       ++hdr.switch_counter;
+    order_stores();
 
     bool shift = false;
     int i;
     for (i = 0; records[i].ptr != NULL; ++i) {
       if (!shift && records[i].key == key) {
         records[i].ptr =
-            (i == 0) ? (P)hdr.leftmost_ptr : records[i - 1].ptr;
+            (i == 0) ? leftmost_slot() : records[i - 1].ptr;
+        if (flush)
+          commit_ptr(i);
         shift = true;
       }
 
       if (shift) {
+        order_stores();
         records[i].key = records[i + 1].key;
+        if (flush)
+          commit_key(i);
+        order_stores();
         records[i].ptr = records[i + 1].ptr;
 
         // flush
-        uint64_t records_ptr = (uint64_t)(&records[i]);
-        int remainder = records_ptr % CACHE_LINE_SIZE;
-        bool do_flush =
-            (remainder == 0) ||
-            ((((int)(remainder + sizeof(entry<T, P>)) / CACHE_LINE_SIZE) == 1) &&
-             ((remainder + sizeof(entry<T, P>)) % CACHE_LINE_SIZE) != 0);
-        if (do_flush) {
-          clflush((char *)records_ptr, CACHE_LINE_SIZE);
+        if (flush) {
+          commit_ptr(i);
+          flush_shift(i);
         }
       }
     }
 
     if (shift) {
+#ifdef FINGERPRINT
+      update_fingerprints(i - 1, true, flush);
+#endif
       --hdr.last_index;
     }
     return shift;
   }
 
-  bool remove(btree<T, P> *bt, T key, bool only_rebalance = false,
+  // Charge the emulated NVM read of a visit to this node, once per visit
+  inline void charge_read() {
+#ifdef HYBRID_INDEX
+    if (hdr.leftmost_ptr != NULL) { // internal nodes are in DRAM
+      return;
+    }
+#endif
+    emulate_nvm_read();
+  }
+
+  // Take the write lock; the first writer after a restart repairs the node
+  inline void lock() {
+    if (hdr.latch.lock()) {
+      repair();
+    }
+  }
+
+  inline void unlock() { hdr.latch.unlock(); }
+
+  // Readers do not repair, and stop at the NULL a crash may have left in
+  // the first slot of a leaf; the first visit to a leaf since the pool was
+  // opened takes the lock once so that repair() runs before the read
+  inline void settle() {
+    if (hdr.leftmost_ptr == NULL && !hdr.latch.current()) {
+      lock();
+      unlock();
+    }
+  }
+
+  // Slot of the first entry of this leaf. A leaf has no leftmost child for
+  // slot 0 to repeat, so a FAST shift through it stores NULL there, and a
+  // crash can leave that NULL in front of valid slots. Up to the slot after
+  // last_index, and at least slot 1, a valid pointer tells that gap from
+  // the end of an empty leaf.
+  inline int first_slot() {
+    if (hdr.leftmost_ptr != NULL || records[0].ptr != NULL) {
+      return 0;
+    }
+    int last = std::min(std::max(hdr.last_index + 1, 1), cardinality - 1);
+    for (int i = 1; i <= last; ++i) {
+      if (records[i].ptr != NULL) {
+        return i;
+      }
+    }
+    return 0;
+  }
+
+  // Shift the slots after slot i one to the left over it, in the order of
+  // remove_key(). Slot i may be a NULL gap at the front of a leaf.
+  void close_slot(int i) {
+    if (IS_FORWARD(hdr.switch_counter))
+      ++hdr.switch_counter;
+    do {
+      records[i].key = records[i + 1].key;
+      commit_key(i);
+      records[i].ptr = records[i + 1].ptr;
+      commit_ptr(i);
+      flush_shift(i);
+    } while (records[++i].ptr != NULL);
+  }
+
+  // Finish what a crash may have cut short in this node. This runs lazily,
+  // under the lock, so a restart does not have to visit every node.
+  //
+  // A FAST shift leaves at most one slot whose pointer repeats its left
+  // neighbour's, or in a leaf a NULL first slot; dropping it completes an
+  // interrupted delete and undoes an interrupted insert. The gap goes
+  // first, as the passes below stop at a NULL. A FAIR split commits when
+  // the sibling pointer is written: if the half that moved to the sibling
+  // is still here, it is cut off as the split would have done. A parent
+  // entry that a split did not get to add stays missing, readers reach the
+  // sibling anyway.
+  void repair() {
+    for (int first = first_slot(); first > 0; first = first_slot()) {
+      close_slot(first - 1);
+    }
+
+    page<T, P, PS> *sibling = hdr.sibling_ptr;
+    if (sibling != NULL) {
+      int low = sibling->first_slot();
+      for (int i = 0; records[i].ptr != NULL; ++i) {
+        bool moved = (hdr.leftmost_ptr == NULL)
+                         ? (sibling->records[low].ptr != NULL &&
+                            records[i].key >= sibling->records[low].key)
+                         : records[i].ptr == child_slot(sibling->hdr.leftmost_ptr);
+        if (moved) {
+          if (IS_FORWARD(hdr.switch_counter))
+            hdr.switch_counter += 2;
+          else
+            ++hdr.switch_counter;
+          records[i].ptr = NULL;
+          clflush((char *)&records[i].ptr, sizeof(P));
+          break;
+        }
+      }
+    }
+
+    for (int i = 0; records[i].ptr != NULL;) {
+      P prev = (i == 0) ? leftmost_slot() : records[i - 1].ptr;
+      if (records[i].ptr != prev) {
+        ++i;
+        continue;
+      }
+      close_slot(i);
+    }
+
+    int num_entries = 0;
+    while (records[num_entries].ptr != NULL) {
+      ++num_entries;
+    }
+#ifdef FINGERPRINT
+    update_fingerprints(num_entries, !IS_FORWARD(hdr.switch_counter), true);
+#endif
+    hdr.last_index = num_entries - 1;
+    clflush((char *)&(hdr.last_index), sizeof(int16_t));
+  }
+
+  bool remove(btree<T, P, PS> *bt, T key, bool only_rebalance = false,
               bool with_lock = true) {
-    hdr.mtx->lock();
+    lock();
+    if (hdr.is_deleted) { // merged away, the caller descends again
+      unlock();
+      return false;
+    }
 
-    bool ret = remove_key(key);
+    bool ret = remove_key(key, in_pool(hdr.level));
 
-    hdr.mtx->unlock();
+    unlock();
 
     return ret;
   }
@@ -264,14 +739,14 @@ public:
    * In Proceedings of the 2014 international symposium on Low power electronics
    * and design (pp. 69-74). ACM.
    */
-  bool remove_rebalancing(btree<T, P> *bt, T key,
+  bool remove_rebalancing(btree<T, P, PS> *bt, T key,
                           bool only_rebalance = false, bool with_lock = true) {
     if (with_lock) {
-      hdr.mtx->lock();
+      lock();
     }
     if (hdr.is_deleted) {
       if (with_lock) {
-        hdr.mtx->unlock();
+        unlock();
       }
       return false;
     }
@@ -280,21 +755,21 @@ public:
       register int num_entries_before = count();
 
       // This node is root
-      if (this == (page<T, P> *)bt->root) {
+      if (this == bt->root) {
         if (hdr.level > 0) {
           if (num_entries_before == 1 && !hdr.sibling_ptr) {
-            bt->root = (char *)hdr.leftmost_ptr;
-            clflush((char *)&(bt->root), sizeof(char *));
+            bt->root = hdr.leftmost_ptr;
+            clflush((char *)&(bt->root), sizeof(bt->root));
 
             hdr.is_deleted = 1;
           }
         }
 
         // Remove the key from this node
-        bool ret = remove_key(key);
+        bool ret = remove_key(key, in_pool(hdr.level));
 
         if (with_lock) {
-          hdr.mtx->unlock();
+          unlock();
         }
         return true;
       }
@@ -306,11 +781,11 @@ public:
       }
 
       // Remove the key from this node
-      bool ret = remove_key(key);
+      bool ret = remove_key(key, in_pool(hdr.level));
 
       if (!should_rebalance) {
         if (with_lock) {
-          hdr.mtx->unlock();
+          unlock();
         }
         return (hdr.leftmost_ptr == NULL) ? ret : true;
       }
@@ -319,37 +794,37 @@ public:
     // Remove a key from the parent node
     T deleted_key_from_parent = 0;
     bool is_leftmost_node = false;
-    page<T, P> *left_sibling;
-    bt->btree_delete_internal(key, (P)this, hdr.level + 1,
+    page<T, P, PS> *left_sibling;
+    bt->btree_delete_internal(key, child_slot(this), hdr.level + 1,
                               &deleted_key_from_parent, &is_leftmost_node,
                               &left_sibling);
 
     if (is_leftmost_node) {
       if (with_lock) {
-        hdr.mtx->unlock();
+        unlock();
       }
 
       if (!with_lock) {
-        hdr.sibling_ptr->hdr.mtx->lock();
+        hdr.sibling_ptr->lock();
       }
       hdr.sibling_ptr->remove(bt, hdr.sibling_ptr->records[0].key, true,
                               with_lock);
       if (!with_lock) {
-        hdr.sibling_ptr->hdr.mtx->unlock();
+        hdr.sibling_ptr->unlock();
       }
       return true;
     }
 
     if (with_lock) {
-      left_sibling->hdr.mtx->lock();
+      left_sibling->lock();
     }
 
     while (left_sibling->hdr.sibling_ptr != this) {
       if (with_lock) {
-        page<T, P> *t = left_sibling->hdr.sibling_ptr;
-        left_sibling->hdr.mtx->unlock();
+        page<T, P, PS> *t = left_sibling->hdr.sibling_ptr;
+        left_sibling->unlock();
         left_sibling = t;
-        left_sibling->hdr.mtx->lock();
+        left_sibling->lock();
       } else
         left_sibling = left_sibling->hdr.sibling_ptr;
     }
@@ -382,7 +857,7 @@ public:
 
           parent_key = records[0].key;
         } else {
-          insert_key(deleted_key_from_parent, (P)hdr.leftmost_ptr,
+          insert_key(deleted_key_from_parent, leftmost_slot(),
                      &num_entries);
 
           for (int i = left_num_entries - 1; i > m; i--) {
@@ -392,8 +867,8 @@ public:
 
           parent_key = left_sibling->records[m].key;
 
-          hdr.leftmost_ptr = (page<T, P> *)left_sibling->records[m].ptr;
-          clflush((char *)&(hdr.leftmost_ptr), sizeof(page<T, P> *));
+          hdr.leftmost_ptr = slot_child(left_sibling->records[m].ptr);
+          clflush((char *)&(hdr.leftmost_ptr), sizeof(hdr.leftmost_ptr));
 
           left_sibling->records[m].ptr = nullptr;
           clflush((char *)&(left_sibling->records[m].ptr), sizeof(char *));
@@ -402,29 +877,27 @@ public:
           clflush((char *)&(left_sibling->hdr.last_index), sizeof(int16_t));
         }
 
-        if (left_sibling == ((page<T, P> *)bt->root)) {
+        if (left_sibling == bt->root) {
           //page *new_root =
           //    new page(left_sibling, parent_key, this, hdr.level + 1);
           //BT
-          page<T, P> *new_root;
-          my_alloc::BasePMPool::ZAllocate((void**)&new_root, sizeof(page));
+          page<T, P, PS> *new_root = allocate(hdr.level + 1);
           new (new_root) page(left_sibling, parent_key, this, hdr.level + 1);
 
           bt->setNewRoot((char *)new_root);
         } else {
           bt->btree_insert_internal((char *)left_sibling, parent_key,
-                                    (P)this, hdr.level + 1);
+                                    child_slot(this), hdr.level + 1);
         }
       } else { // from leftmost case
         hdr.is_deleted = 1;
         clflush((char *)&(hdr.is_deleted), sizeof(uint8_t));
         //BT
-        page<T, P> *new_sibling;
-        my_alloc::BasePMPool::ZAllocate((void**)&new_sibling, sizeof(page));
+        page<T, P, PS> *new_sibling = allocate(hdr.level);
         new (new_sibling) page(hdr.level);
         // = new page(hdr.level);
 
-        new_sibling->hdr.mtx->lock();
+        new_sibling->lock();
         new_sibling->hdr.sibling_ptr = hdr.sibling_ptr;
 
         int num_dist_entries = num_entries - m;
@@ -444,12 +917,12 @@ public:
           clflush((char *)(new_sibling), sizeof(page));
 
           left_sibling->hdr.sibling_ptr = new_sibling;
-          clflush((char *)&(left_sibling->hdr.sibling_ptr), sizeof(page<T, P> *));
+          clflush((char *)&(left_sibling->hdr.sibling_ptr), sizeof(left_sibling->hdr.sibling_ptr));
 
           parent_key = new_sibling->records[0].key;
         } else {
           left_sibling->insert_key(deleted_key_from_parent,
-                                   (P)hdr.leftmost_ptr, &left_num_entries);
+                                   leftmost_slot(), &left_num_entries);
 
           for (int i = 0; i < num_dist_entries - 1; i++) {
             left_sibling->insert_key(records[i].key, records[i].ptr,
@@ -459,7 +932,7 @@ public:
           parent_key = records[num_dist_entries - 1].key;
 
           new_sibling->hdr.leftmost_ptr =
-              (page<T, P> *)records[num_dist_entries - 1].ptr;
+              slot_child(records[num_dist_entries - 1].ptr);
           for (int i = num_dist_entries; records[i].ptr != NULL; i++) {
             new_sibling->insert_key(records[i].key, records[i].ptr,
                                     &new_sibling_cnt, false);
@@ -467,23 +940,22 @@ public:
           clflush((char *)(new_sibling), sizeof(page));
 
           left_sibling->hdr.sibling_ptr = new_sibling;
-          clflush((char *)&(left_sibling->hdr.sibling_ptr), sizeof(page<T, P> *));
+          clflush((char *)&(left_sibling->hdr.sibling_ptr), sizeof(left_sibling->hdr.sibling_ptr));
         }
 
-        if (left_sibling == ((page<T, P> *)bt->root)) {
+        if (left_sibling == bt->root) {
           //page *new_root =
           //    new page(left_sibling, parent_key, new_sibling, hdr.level + 1);
           //BT
-          page<T, P> *new_root;
-          my_alloc::BasePMPool::ZAllocate((void**)&new_root, sizeof(page));
+          page<T, P, PS> *new_root = allocate(hdr.level + 1);
           new (new_root) page(left_sibling, parent_key, new_sibling, hdr.level + 1);
           bt->setNewRoot((char *)new_root);
         } else {
           bt->btree_insert_internal((char *)left_sibling, parent_key,
-                                    (P)new_sibling, hdr.level + 1);
+                                    child_slot(new_sibling), hdr.level + 1);
         }
 
-        new_sibling->hdr.mtx->unlock();
+        new_sibling->unlock();
       }
     } else {
       hdr.is_deleted = 1;
@@ -491,7 +963,7 @@ public:
 
       if (hdr.leftmost_ptr)
         left_sibling->insert_key(deleted_key_from_parent,
-                                 (P)hdr.leftmost_ptr, &left_num_entries);
+                                 leftmost_slot(), &left_num_entries);
 
       for (int i = 0; records[i].ptr != NULL; ++i) {
         left_sibling->insert_key(records[i].key, records[i].ptr,
@@ -499,38 +971,77 @@ public:
       }
 
       left_sibling->hdr.sibling_ptr = hdr.sibling_ptr;
-      clflush((char *)&(left_sibling->hdr.sibling_ptr), sizeof(page<T, P> *));
+      clflush((char *)&(left_sibling->hdr.sibling_ptr), sizeof(left_sibling->hdr.sibling_ptr));
     }
 
     if (with_lock) {
-      left_sibling->hdr.mtx->unlock();
-      hdr.mtx->unlock();
+      left_sibling->unlock();
+      unlock();
     }
 
     return true;
   }
 
+  // Stores to one cache line become durable in program order, so a line
+  // that keeps being written may be flushed once, when the writes move on
+  // to another line. With pending set, insert_key() leaves the line of the
+  // slot it fills unflushed and reports it there; a later call flushes it
+  // first unless it starts in the same line. The caller flushes what is
+  // left pending and rebuilds the fingerprints, which are then not
+  // touched. The split layout always flushes.
+  inline void flush_pending(char **pending, char *next) {
+    if (*pending != NULL &&
+        (next == NULL || (uint64_t)*pending / CACHE_LINE_SIZE !=
+                             (uint64_t)next / CACHE_LINE_SIZE)) {
+      clflush(*pending, sizeof(P));
+      *pending = NULL;
+    }
+  }
+
+  inline void finish_slot(int i, bool flush, char **pending) {
+    if (pending != NULL) {
+      *pending = (char *)&records[i].ptr;
+    } else if (flush) {
+      flush_slot(i);
+    }
+  }
+
   inline void insert_key(T key, P ptr, int *num_entries,
-                         bool flush = true, bool update_last_index = true) {
+                         bool flush = true, bool update_last_index = true,
+                         char **pending = NULL) {
+#ifdef SOA_LAYOUT
+    if (pending != NULL) {
+      flush_pending(pending, NULL);
+      pending = NULL;
+    }
+#endif
     // update switch_counter
     if (!IS_FORWARD(hdr.switch_counter))
       ++hdr.switch_counter;
+    order_stores();
 
     // FAST
     if (*num_entries == 0) { // this page is empty
-      entry<T, P> *new_entry = (entry<T, P> *)&records[0];
-      entry<T, P> *array_end = (entry<T, P> *)&records[1];
-      new_entry->key = (T)key;
-      new_entry->ptr = ptr;
-
-      array_end->ptr = (P)NULL;
-
+      if (pending != NULL) {
+        flush_pending(pending, NULL);
+      }
+      records[0].key = (T)key;
       if (flush) {
-        clflush((char *)this, CACHE_LINE_SIZE);
+        commit_key(0);
       }
+      order_stores();
+      records[0].ptr = ptr;
+
+      records[1].ptr = (P)NULL;
+
+      finish_slot(0, flush, pending);
     } else {
-      int i = *num_entries - 1, inserted = 0, to_flush_cnt = 0;
+      int i = *num_entries - 1, inserted = 0;
+      if (pending != NULL) {
+        flush_pending(pending, (char *)&records[*num_entries + 1].ptr);
+      }
       records[*num_entries + 1].ptr = records[*num_entries].ptr;
+      order_stores();
       if (flush) {
         if ((uint64_t) & (records[*num_entries + 1].ptr) % CACHE_LINE_SIZE == 0)
           clflush((char *)&(records[*num_entries + 1].ptr), sizeof(char *));
@@ -540,82 +1051,177 @@ public:
       for (i = *num_entries - 1; i >= 0; i--) {
         if (key < records[i].key) {
           records[i + 1].ptr = records[i].ptr;
+          if (flush)
+            commit_ptr(i + 1);
+          order_stores();
           records[i + 1].key = records[i].key;
 
           if (flush) {
-            uint64_t records_ptr = (uint64_t)(&records[i + 1]);
-
-            int remainder = records_ptr % CACHE_LINE_SIZE;
-            bool do_flush =
-                (remainder == 0) ||
-                ((((int)(remainder + sizeof(entry<T, P>)) / CACHE_LINE_SIZE) == 1) &&
-                 ((remainder + sizeof(entry<T, P>)) % CACHE_LINE_SIZE) != 0);
-            if (do_flush) {
-              clflush((char *)records_ptr, CACHE_LINE_SIZE);
-              to_flush_cnt = 0;
-            } else
-              ++to_flush_cnt;
+            commit_key(i + 1);
+            flush_shift(i + 1);
           }
+          order_stores();
         } else {
           records[i + 1].ptr = records[i].ptr;
+          if (flush)
+            commit_ptr(i + 1);
+          order_stores();
           records[i + 1].key = key;
+          if (flush)
+            commit_key(i + 1);
+          order_stores();
           records[i + 1].ptr = ptr;
 
-          if (flush)
-            clflush((char *)&records[i + 1], sizeof(entry<T, P>));
+          finish_slot(i + 1, flush, pending);
           inserted = 1;
           break;
         }
       }
       if (inserted == 0) {
-        records[0].ptr = (P)hdr.leftmost_ptr;
+        records[0].ptr = leftmost_slot();
+        if (flush)
+          commit_ptr(0);
+        order_stores();
         records[0].key = key;
-        records[0].ptr = ptr;
         if (flush)
-          clflush((char *)&records[0], sizeof(entry<T, P>));
+          commit_key(0);
+        order_stores();
+        records[0].ptr = ptr;
+        finish_slot(0, flush, pending);
       }
     }
 
+#ifdef FINGERPRINT
+    if (pending == NULL) {
+      update_fingerprints(*num_entries + 1, false, flush);
+    }
+#endif
+
     if (update_last_index) {
       hdr.last_index = *num_entries;
     }
     ++(*num_entries);
   }
 
-  // Insert a new key - FAST and FAIR
-  page<T, P> *store(btree<T, P> *bt, char *left, T key, P right, bool flush,
-              bool with_lock, page<T, P> *invalid_sibling = NULL) {
+  // Slot of key among the first n entries of this leaf, -1 if it is not
+  // there. The lock must be held, so no shift is under way and the keys
+  // are in order.
+  inline int find_key(T key, int n) {
+    int lo = 0, hi = n;
+    while (lo < hi) {
+      int mid = (lo + hi) / 2;
+      if (records[mid].key < key) {
+        lo = mid + 1;
+      } else {
+        hi = mid;
+      }
+    }
+    return (lo < n && records[lo].key == key) ? lo : -1;
+  }
+
+  // Swap the value in slot i: one 8-byte store, atomic on its own, and
+  // one flush, with no shift
+  inline void replace_value(int i, P value) {
+    records[i].ptr = value;
+    clflush((char *)&records[i].ptr, sizeof(P));
+  }
+
+  // Whether key belongs to sibling, the right neighbour of this node: it
+  // is at least the sibling's first key, or in a leaf equal to it. A leaf
+  // emptied by deletes keeps the key its last entry had in records[0],
+  // which bounds nothing any more, so nothing is sent to it then, as in
+  // repair(); the keys are kept to the leaf's range by the parent instead.
+  // The first key of a leaf not yet repaired is read past a crash's gap.
+  static inline bool belongs_right(page<T, P, PS> *sibling, T key) {
+    if (sibling == NULL) {
+      return false;
+    }
+    bool leaf = sibling->hdr.leftmost_ptr == NULL;
+    int low = sibling->first_slot();
+    if (leaf && sibling->records[low].ptr == NULL) {
+      return false;
+    }
+    T first = sibling->records[low].key;
+    return key > first || (key == first && leaf);
+  }
+
+  // Overwrite the value of key in place. Returns 1 if it was done, 0 if
+  // the key is not in the tree, or -1 if this node has been deleted and
+  // the caller has to descend again.
+  int update(T key, P value) {
+    lock();
+    if (hdr.is_deleted) {
+      unlock();
+      return -1;
+    }
+
+    page<T, P, PS> *sibling = hdr.sibling_ptr;
+    if (belongs_right(sibling, key)) {
+      unlock();
+      return sibling->update(key, value);
+    }
+
+    int i = find_key(key, count());
+    if (i >= 0) {
+      replace_value(i, value);
+    }
+    unlock();
+    return i >= 0;
+  }
+
+  // Insert a new key - FAST and FAIR. A key already in the leaf is not
+  // inserted again: *existed is set and, with replace, its value is
+  // swapped instead, under the same lock.
+  page<T, P, PS> *store(btree<T, P, PS> *bt, char *left, T key, P right, bool flush,
+              bool with_lock, page<T, P, PS> *invalid_sibling = NULL,
+              bool replace = false, bool *existed = NULL) {
     if (with_lock) {
-      hdr.mtx->lock(); // Lock the write lock
+      lock(); // Lock the write lock
     }
     if (hdr.is_deleted) {
       if (with_lock) {
-        hdr.mtx->unlock();
+        unlock();
       }
 
       return NULL;
     }
 
     // If this node has a sibling node,
-    if (hdr.sibling_ptr && (hdr.sibling_ptr != invalid_sibling)) {
+    if (hdr.sibling_ptr != invalid_sibling) {
       // Compare this key with the first key of the sibling
-      if (key > hdr.sibling_ptr->records[0].key) {
+      if (belongs_right(hdr.sibling_ptr, key)) {
         if (with_lock) {
-          hdr.mtx->unlock(); // Unlock the write lock
+          unlock(); // Unlock the write lock
         }
         return hdr.sibling_ptr->store(bt, NULL, key, right, true, with_lock,
-                                      invalid_sibling);
+                                      invalid_sibling, replace, existed);
       }
     }
 
     register int num_entries = count();
 
+    if (hdr.leftmost_ptr == NULL) {
+      int i = find_key(key, num_entries);
+      if (i >= 0) {
+        if (replace) {
+          replace_value(i, right);
+        }
+        if (existed) {
+          *existed = true;
+        }
+        if (with_lock) {
+          unlock();
+        }
+        return this;
+      }
+    }
+
     // FAST
     if (num_entries < cardinality - 1) {
       insert_key(key, right, &num_entries, flush);
 
       if (with_lock) {
-        hdr.mtx->unlock(); // Unlock the write lock
+        unlock(); // Unlock the write lock
       }
 
       return this;
@@ -624,8 +1230,7 @@ public:
       // create a new node
       //page *sibling = new page(hdr.level);
       //BT: use PMDK allocator
-      page<T, P> *sibling;
-      my_alloc::BasePMPool::ZAllocate((void**)&sibling, sizeof(page));
+      page<T, P, PS> *sibling = allocate(hdr.level);
       new (sibling) page(hdr.level);
 
       register int m = (int)ceil(num_entries / 2);
@@ -643,13 +1248,20 @@ public:
           sibling->insert_key(records[i].key, records[i].ptr, &sibling_cnt,
                               false);
         }
-        sibling->hdr.leftmost_ptr = (page<T, P> *)records[m].ptr;
+        sibling->hdr.leftmost_ptr = slot_child(records[m].ptr);
       }
 
       sibling->hdr.sibling_ptr = hdr.sibling_ptr;
       clflush((char *)sibling, sizeof(page));
 
       hdr.sibling_ptr = sibling;
+#ifdef FINGERPRINT
+      // Hide the migrated half from fingerprint lookups; they now reach it
+      // through the sibling. This lies in the line flushed with hdr.
+      for (int i = m; i < fingerprint_bytes; ++i) {
+        ((volatile uint8_t *)fingerprints)[i] = 0;
+      }
+#endif
       clflush((char *)&hdr, sizeof(hdr));
 
       // set to NULL
@@ -658,14 +1270,14 @@ public:
       else
         ++hdr.switch_counter;
       records[m].ptr = NULL;
-      clflush((char *)&records[m], sizeof(entry<T, P>));
+      clflush((char *)&records[m].ptr, sizeof(P));
 
       hdr.last_index = m - 1;
       clflush((char *)&(hdr.last_index), sizeof(int16_t));
 
       num_entries = hdr.last_index + 1;
 
-      page<T, P> *ret;
+      page<T, P, PS> *ret;
 
       // insert the key
       if (key < split_key) {
@@ -677,22 +1289,21 @@ public:
       }
 
       // Set a new root or insert the split key to the parent
-      if (bt->root == (char *)this) { // only one node can update the root ptr
+      if (bt->root == this) { // only one node can update the root ptr
         //page *new_root =
         //    new page((page *)this, split_key, sibling, hdr.level + 1);
-        page<T, P> *new_root;
-        my_alloc::BasePMPool::ZAllocate((void**)&new_root, sizeof(page));
-        new (new_root) page((page<T, P> *)this, split_key, sibling, hdr.level + 1);
+        page<T, P, PS> *new_root = allocate(hdr.level + 1);
+        new (new_root) page((page<T, P, PS> *)this, split_key, sibling, hdr.level + 1);
         bt->setNewRoot((char *)new_root);
 
         if (with_lock) {
-          hdr.mtx->unlock(); // Unlock the write lock
+          unlock(); // Unlock the write lock
         }
       } else {
         if (with_lock) {
-          hdr.mtx->unlock(); // Unlock the write lock
+          unlock(); // Unlock the write lock
         }
-        bt->btree_insert_internal(NULL, split_key, (P)sibling,
+        bt->btree_insert_internal(NULL, split_key, child_slot(sibling),
                                   hdr.level + 1);
       }
 
@@ -700,123 +1311,450 @@ public:
     }
   }
 
-  // Search keys with linear search
-  void linear_search_range(T min, T max,
-                           unsigned long *buf) {
-    int i, off = 0;
+  // Insert a run of ascending keys into this leaf under one lock
+  // acquisition and return how many were taken, 0 if the node has been
+  // deleted and the caller has to descend again. The run stops at bound,
+  // the separator above the leaf that the descent went through (NULL if
+  // none), at the first key that belongs to the sibling or once the node
+  // is full; a full node takes one key through store(), which splits it.
+  // The sibling's first key alone is not a bound: once it is deleted, keys
+  // between it and the separator would be put here, where lookups, which
+  // route by the separator, do not look.
+  int store_batch(btree<T, P, PS> *bt, const std::pair<T, P> *batch, int n,
+                  const T *bound) {
+    lock();
+    if (hdr.is_deleted) {
+      unlock();
+      return 0;
+    }
+
+    page<T, P, PS> *sibling = hdr.sibling_ptr;
+    if (belongs_right(sibling, batch[0].first)) {
+      unlock();
+      return sibling->store_batch(bt, batch, n, bound);
+    }
+
+    int num_entries = count();
+    if (num_entries >= cardinality - 1) {
+      unlock();
+      return store(bt, NULL, batch[0].first, batch[0].second, true, true)
+                 ? 1
+                 : 0;
+    }
+
+    int taken = 0;
+    char *pending = NULL;
+    while (taken < n && num_entries < cardinality - 1 &&
+           (bound == NULL || batch[taken].first < *bound) &&
+           !belongs_right(sibling, batch[taken].first)) {
+      // keys already here, or twice in the batch, are taken but skipped;
+      // below bound, a key that is in the tree can only be in this leaf
+      if (find_key(batch[taken].first, num_entries) < 0) {
+        insert_key(batch[taken].first, batch[taken].second, &num_entries,
+                   true, true, &pending);
+      }
+      ++taken;
+    }
+    flush_pending(&pending, NULL);
+#ifdef FINGERPRINT
+    update_fingerprints(num_entries, false, true);
+#endif
+
+    unlock();
+    return taken;
+  }
+
+  // Copy the live entries of this leaf to keys/ptrs in ascending order and
+  // return how many there are; *sibling is the leaf to go on with. Unlike
+  // a lookup, which only needs the key it is after, a copy must not see a
+  // key twice or miss one, so it is taken again if a writer was at work on
+  // the leaf meanwhile, not just if a shift changed direction.
+  int snapshot(T *keys, P *ptrs, page<T, P, PS> **sibling) {
     uint8_t previous_switch_counter;
-    page<T, P> *current = this;
+    uint32_t version;
+    int n;
+    charge_read();
+    settle();
+    do {
+      previous_switch_counter = hdr.switch_counter;
+      version = hdr.latch.version();
+      *sibling = hdr.sibling_ptr;
+      n = 0;
+      if (IS_FORWARD(previous_switch_counter)) {
+        for (int i = 0; records[i].ptr != NULL; ++i) {
+          snapshot_slot(i, keys, ptrs, &n);
+        }
+      } else {
+        for (int i = count() - 1; i >= 0; --i) {
+          snapshot_slot(i, keys, ptrs, &n);
+        }
+        std::reverse(keys, keys + n);
+        std::reverse(ptrs, ptrs + n);
+      }
+    } while (previous_switch_counter != hdr.switch_counter ||
+             modified_since(version));
+    return n;
+  }
 
-    while (current) {
-      int old_off = off;
-      do {
-        previous_switch_counter = current->hdr.switch_counter;
-        off = old_off;
+  inline void snapshot_slot(int i, T *keys, P *ptrs, int *n) {
+    T key = records[i].key;
+    P ptr = records[i].ptr;
+    if (ptr != NULL && (i == 0 || ptr != records[i - 1].ptr) &&
+        key == records[i].key) {
+      keys[*n] = key;
+      ptrs[(*n)++] = ptr;
+    }
+  }
 
-        T tmp_key;
-        P tmp_ptr;
+  // Copy the children of this internal node, leftmost first, and the keys
+  // between them; returns the number of children
+  int snapshot_children(page<T, P, PS> **children, T *keys) {
+    P ptrs[cardinality];
+    page<T, P, PS> *sibling;
+    uint32_t version;
+    int n;
+    do {
+      version = hdr.latch.version();
+      children[0] = hdr.leftmost_ptr;
+      n = snapshot(keys, ptrs, &sibling);
+    } while (modified_since(version));
+    for (int i = 0; i < n; ++i) {
+      children[i + 1] = slot_child(ptrs[i]);
+    }
+    return n + 1;
+  }
 
-        if (IS_FORWARD(previous_switch_counter)) {
-          if ((tmp_key = current->records[0].key) > min) {
-            if (tmp_key < max) {
-              if ((tmp_ptr = current->records[0].ptr) != NULL) {
-                if (tmp_key == current->records[0].key) {
-                  if (tmp_ptr) {
-                    buf[off++] = (unsigned long)tmp_ptr;
-                  }
-                }
-              }
-            } else
-              return;
-          }
+  // Return the child of this internal node, or its sibling, that covers
+  // key, and lower *bound to the separator on the child's right, if there
+  // is one; *bounded says whether *bound has been set
+  page<T, P, PS> *route(T key, T *bound, bool *bounded) {
+    T keys[cardinality];
+    P ptrs[cardinality];
+    page<T, P, PS> *sibling;
+    int n = snapshot(keys, ptrs, &sibling);
+    if (sibling != NULL) {
+      T low = sibling->records[0].key;
+      if (key >= low) {
+        return sibling;
+      }
+      keys[n] = low;
+    }
+    int i = std::upper_bound(keys, keys + n, key) - keys;
+    if (i < n || sibling != NULL) {
+      if (!*bounded || keys[i] < *bound) {
+        *bound = keys[i];
+        *bounded = true;
+      }
+    }
+    return i == 0 ? hdr.leftmost_ptr.get() : slot_child(ptrs[i - 1]);
+  }
 
-          for (i = 1; current->records[i].ptr != NULL; ++i) {
-            if ((tmp_key = current->records[i].key) > min) {
-              if (tmp_key < max) {
-                if ((tmp_ptr = current->records[i].ptr) !=
-                    current->records[i - 1].ptr) {
-                  if (tmp_key == current->records[i].key) {
-                    if (tmp_ptr)
-                      buf[off++] = (unsigned long)tmp_ptr;
-                  }
-                }
-              } else
-                return;
-            }
-          }
-        } else {
-          for (i = count() - 1; i > 0; --i) {
-            if ((tmp_key = current->records[i].key) > min) {
-              if (tmp_key < max) {
-                if ((tmp_ptr = current->records[i].ptr) !=
-                    current->records[i - 1].ptr) {
-                  if (tmp_key == current->records[i].key) {
-                    if (tmp_ptr)
-                      buf[off++] = (unsigned long)tmp_ptr;
-                  }
-                }
-              } else
-                return;
-            }
-          }
+#if defined(SIMD) && defined(__AVX2__)
+  // Vectorized key comparison is only valid for 8-byte integer keys with
+  // 8-byte pointers
+  static const bool simd_keys = std::is_integral<T>::value &&
+                                std::is_signed<T>::value && sizeof(T) == 8 &&
+                                sizeof(P) == 8;
+#ifdef __AVX512F__
+  static const int simd_width = 8;
+#else
+  static const int simd_width = 4;
+#endif
+
+  // Compare the keys of records[base, base + simd_width) against "key".
+  // Bit j of *hit is set if records[base + j].key == key (leaf) or
+  // records[base + j].key > key (internal); bit j of *end is set if
+  // records[base + j].ptr is NULL.
+  inline void simd_compare(int base, T key, bool leaf, uint32_t *hit,
+                           uint32_t *end) {
+#if defined(__AVX512F__) && defined(SOA_LAYOUT)
+    __m512i keys = _mm512_loadu_si512((const void *)&records.keys[base]);
+    __m512i ptrs = _mm512_loadu_si512((const void *)&records.ptrs[base]);
+    __m512i key_data = _mm512_set1_epi64((long long)key);
+    *hit = leaf ? _mm512_cmpeq_epi64_mask(keys, key_data)
+                : _mm512_cmpgt_epi64_mask(keys, key_data);
+    *end = _mm512_cmpeq_epi64_mask(ptrs, _mm512_setzero_si512());
+#elif defined(__AVX512F__)
+    const __m512i key_idx = _mm512_set_epi64(14, 12, 10, 8, 6, 4, 2, 0);
+    const __m512i ptr_idx = _mm512_set_epi64(15, 13, 11, 9, 7, 5, 3, 1);
+    __m512i lo = _mm512_loadu_si512((const void *)&records[base]);
+    __m512i hi = _mm512_loadu_si512((const void *)&records[base + 4]);
+    __m512i keys = _mm512_permutex2var_epi64(lo, key_idx, hi);
+    __m512i ptrs = _mm512_permutex2var_epi64(lo, ptr_idx, hi);
+    __m512i key_data = _mm512_set1_epi64((long long)key);
+    *hit = leaf ? _mm512_cmpeq_epi64_mask(keys, key_data)
+                : _mm512_cmpgt_epi64_mask(keys, key_data);
+    *end = _mm512_cmpeq_epi64_mask(ptrs, _mm512_setzero_si512());
+#elif defined(SOA_LAYOUT)
+    __m256i keys = _mm256_loadu_si256((const __m256i *)&records.keys[base]);
+    __m256i ptrs = _mm256_loadu_si256((const __m256i *)&records.ptrs[base]);
+    __m256i key_data = _mm256_set1_epi64x((long long)key);
+    __m256i rv_mask = leaf ? _mm256_cmpeq_epi64(keys, key_data)
+                           : _mm256_cmpgt_epi64(keys, key_data);
+    *hit = _mm256_movemask_pd(_mm256_castsi256_pd(rv_mask));
+    *end = _mm256_movemask_pd(_mm256_castsi256_pd(
+        _mm256_cmpeq_epi64(ptrs, _mm256_setzero_si256())));
+#else
+    __m256i lo = _mm256_loadu_si256((const __m256i *)&records[base]);
+    __m256i hi = _mm256_loadu_si256((const __m256i *)&records[base + 2]);
+    // unpack yields {k0, k2, k1, k3}; the permute restores slot order
+    __m256i keys =
+        _mm256_permute4x64_epi64(_mm256_unpacklo_epi64(lo, hi), 0xD8);
+    __m256i ptrs =
+        _mm256_permute4x64_epi64(_mm256_unpackhi_epi64(lo, hi), 0xD8);
+    __m256i key_data = _mm256_set1_epi64x((long long)key);
+    __m256i rv_mask = leaf ? _mm256_cmpeq_epi64(keys, key_data)
+                           : _mm256_cmpgt_epi64(keys, key_data);
+    *hit = _mm256_movemask_pd(_mm256_castsi256_pd(rv_mask));
+    *end = _mm256_movemask_pd(_mm256_castsi256_pd(
+        _mm256_cmpeq_epi64(ptrs, _mm256_setzero_si256())));
+#endif
+  }
+#else
+  static const bool simd_keys = false;
+#endif
+
+  // Read key i again, from memory: the key-pointer-key check that rejects a
+  // slot a FAST shift rewrote in between is void if the compiler reuses the
+  // first read
+  inline T reread_key(int i) { return *(volatile T *)&records[i].key; }
+
+  // Check a candidate slot found by the forward scan. A slot whose pointer
+  // equals its left neighbour's is a transient duplicate made by FAST and
+  // must be skipped; the key is re-read to detect a concurrent shift.
+  inline bool forward_match(int i, T key, bool leaf, P *ret) {
+    T k;
+    P t;
+    P prev = (i == 0) ? leftmost_slot() : records[i - 1].ptr;
+    if (leaf) {
+      if ((k = records[i].key) == key && (t = records[i].ptr) != prev && t &&
+          k == reread_key(i)) {
+        *ret = t;
+        return true;
+      }
+    } else {
+      if (key < records[i].key && prev != records[i].ptr) {
+        *ret = prev;
+        return true;
+      }
+    }
+    return false;
+  }
 
-          if ((tmp_key = current->records[0].key) > min) {
-            if (tmp_key < max) {
-              if ((tmp_ptr = current->records[0].ptr) != NULL) {
-                if (tmp_key == current->records[0].key) {
-                  if (tmp_ptr) {
-                    buf[off++] = (unsigned long)tmp_ptr;
-                  }
-                }
-              }
-            } else
-              return;
-          }
+#if defined(SIMD) && defined(__AVX2__)
+  // Number of leading slots to scan one by one so that every later vector
+  // load is aligned to its own size, or -1 if the slots can not be aligned
+  inline int simd_head() {
+    const int load = simd_width * 8; // bytes of keys per vector load
+#ifdef SOA_LAYOUT
+    const int stride = sizeof(T);
+    uintptr_t addr = (uintptr_t)&records.keys[0];
+#else
+    const int stride = sizeof(entry<T, P>);
+    uintptr_t addr = (uintptr_t)&records[0];
+#endif
+    if (addr % stride) {
+      return -1;
+    }
+    return (int)((load - addr % load) % load) / stride;
+  }
+
+  // Vector part of forward_scan(). Returns 1 on a valid match, 0 if the key
+  // is absent (*i is the terminator), or -1 if a plain scan has to resume
+  // at slot *i.
+  //
+  // A key that FAST is shifting right is only guaranteed to be seen by a
+  // reader that visits slots in ascending order. An aligned load reads one
+  // cache line as a single snapshot, but a split load may observe a later
+  // slot before an earlier one, so loads never straddle lines. A snapshot
+  // also goes stale: once a hit fails validation, the key may have moved
+  // right and the remaining slots are read one by one.
+  inline int simd_forward_scan(T key, bool leaf, P *ret, int *i) {
+    int head = simd_head();
+    if (head < 0) {
+      return -1;
+    }
+
+    for (; *i < head; ++*i) {
+      if (records[*i].ptr == NULL) {
+        return 0;
+      }
+      if (forward_match(*i, key, leaf, ret)) {
+        return 1;
+      }
+    }
+
+    uint32_t hit, end;
+    for (; *i + simd_width <= cardinality; *i += simd_width) {
+      simd_compare(*i, key, leaf, &hit, &end);
+      if (end) {
+        // only the slots in front of the first NULL are valid
+        hit &= (1u << __builtin_ctz(end)) - 1;
+      }
+      if (hit) {
+        int j = *i + __builtin_ctz(hit);
+        if (forward_match(j, key, leaf, ret)) {
+          return 1;
         }
-      } while (previous_switch_counter != current->hdr.switch_counter);
+        *i = j + 1;
+        return -1;
+      }
+      if (end) {
+        *i += __builtin_ctz(end);
+        return 0;
+      }
+    }
+    return -1;
+  }
+#endif
+
+  // Forward scan over the slots in front of the NULL terminator. Returns
+  // true and sets *ret on the first valid match; otherwise returns false and
+  // sets *last to the terminator index.
+  inline bool forward_scan(T key, bool leaf, P *ret, int *last) {
+    int i = 0;
+#if defined(SIMD) && defined(__AVX2__)
+    if (simd_keys) {
+      int found = simd_forward_scan(key, leaf, ret, &i);
+      if (found >= 0) {
+        *last = i;
+        return found;
+      }
+    }
+#endif
+    for (; records[i].ptr != NULL; ++i) {
+      if (forward_match(i, key, leaf, ret)) {
+        return true;
+      }
+    }
+    *last = i;
+    return false;
+  }
+
+  // Route "key" through an internal node by a branchless binary search over
+  // the first last_index + 1 keys. FAST only ever duplicates a slot while it
+  // shifts, so the keys stay sorted, but the slot the search lands on may be
+  // a transient duplicate or the node may have grown under it; the answer is
+  // only taken if both slots around it pass the same duplicate-pointer test
+  // as the scan, otherwise false is returned and the caller scans.
+  inline bool binary_route(T key, P *ret) {
+    int n = hdr.last_index + 1;
+    if (n < BSEARCH_MIN_ENTRIES || n > cardinality - 1) {
+      return false;
+    }
+
+    int base = 0;
+    for (int len = n; len > 1;) {
+      int half = len / 2;
+      // both possible next probes, so the misses overlap
+      __builtin_prefetch(&records[base + half / 2].key);
+      __builtin_prefetch(&records[base + half + half / 2].key);
+      base = (records[base + half].key <= key) ? base + half : base;
+      len -= half;
+    }
+    int pos = base + (records[base].key <= key); // first key above "key"
 
-      current = current->hdr.sibling_ptr;
+    // the slot on the left supplies the child and must be valid
+    P prev = (pos <= 1) ? leftmost_slot() : records[pos - 2].ptr;
+    P child = (pos == 0) ? leftmost_slot() : records[pos - 1].ptr;
+    if (pos > 0 && (child == prev || key < records[pos - 1].key)) {
+      return false;
+    }
+    if (pos == n) {
+      // past the last key, which must still be the last one
+      if (records[pos].ptr != NULL) {
+        return false;
+      }
+      *ret = child;
+      return true;
     }
+    return forward_match(pos, key, false, ret);
   }
 
+  // True if a writer held the lock when "version" was read or has taken it
+  // since. A leaf lookup that missed under a writer is repeated: FAST keeps
+  // hits safe, but a key shifted past the reader can be missed.
+  inline bool modified_since(uint32_t version) {
+    if (version & 1) {
+      cpu_pause();
+      return true;
+    }
+    return hdr.latch.version() != version;
+  }
+
+#ifdef FINGERPRINT
+  // Look key up in this leaf through the fingerprints
+  P fingerprint_search(T key) {
+    uint8_t previous_switch_counter;
+    uint32_t version;
+    P ret = NULL;
+    P t;
+    int i;
+
+    // Only the fingerprint line and the candidate slots are touched.
+    // Candidates are visited in the switch_counter direction, like the
+    // full scan, so a key moved by a concurrent shift is not skipped.
+    do {
+      previous_switch_counter = hdr.switch_counter;
+      version = hdr.latch.version();
+      ret = NULL;
+
+      int last = hdr.last_index + 1;
+      bool forward = IS_FORWARD(previous_switch_counter);
+      uint32_t candidates[fingerprint_blocks];
+      fingerprint_candidates(key, forward, candidates);
+      for (int n = 0; n < fingerprint_blocks && !ret; ++n) {
+        int b = forward ? n : fingerprint_blocks - 1 - n;
+        uint32_t c = candidates[b];
+        while (c) {
+          int j = forward ? __builtin_ctz(c) : 31 - __builtin_clz(c);
+          c &= ~(1u << j);
+          i = b * 32 + j;
+          if (i <= last && forward_match(i, key, true, &t)) {
+            ret = t;
+            break;
+          }
+        }
+      }
+      // The widening covers one shift; a key may have moved further if
+      // a writer was or has been at work, so a miss is not trusted then
+    } while (hdr.switch_counter != previous_switch_counter ||
+             (!ret && modified_since(version)));
+    return ret;
+  }
+#endif
+
   P linear_search(T key) {
     int i = 1;
     uint8_t previous_switch_counter;
+    uint32_t version;
     P ret = NULL;
     P t;
     T k;
 
+    charge_read();
+
     if (hdr.leftmost_ptr == NULL) { // Search a leaf node
+      settle(); // the fingerprints are rebuilt by then too
+#ifdef FINGERPRINT
+      ret = fingerprint_search(key);
+#else
       do {
         previous_switch_counter = hdr.switch_counter;
+        version = hdr.latch.version();
         ret = NULL;
 
         // search from left ro right
         if (IS_FORWARD(previous_switch_counter)) {
-          if ((k = records[0].key) == key) {
-            if ((t = records[0].ptr) != NULL) {
-              if (k == records[0].key) {
-                ret = t;
-                continue;
-              }
-            }
-          }
-
-          for (i = 1; records[i].ptr != NULL; ++i) {
-            if ((k = records[i].key) == key) {
-              if (records[i - 1].ptr != (t = records[i].ptr)) {
-                if (k == records[i].key) {
-                  ret = t;
-                  break;
-                }
-              }
-            }
+          if (!forward_scan(key, true, &t, &i)) {
+            continue;
           }
+          ret = t;
         } else { // search from right to left
           for (i = count() - 1; i > 0; --i) {
             if ((k = records[i].key) == key) {
               if (records[i - 1].ptr != (t = records[i].ptr) && t) {
-                if (k == records[i].key) {
+                if (k == reread_key(i)) {
                   ret = t;
                   break;
                 }
@@ -827,7 +1765,7 @@ public:
           if (!ret) {
             if ((k = records[0].key) == key) {
               if (NULL != (t = records[0].ptr) && t) {
-                if (k == records[0].key) {
+                if (k == reread_key(0)) {
                   ret = t;
                   continue;
                 }
@@ -835,47 +1773,40 @@ public:
             }
           }
         }
-      } while (hdr.switch_counter != previous_switch_counter);
+      } while (hdr.switch_counter != previous_switch_counter ||
+               (!ret && modified_since(version)));
+#endif
 
       if (ret) {
         return ret;
       }
 
-      if ((t = (P)hdr.sibling_ptr) && key >= ((page<T, P> *)t)->records[0].key)
-        return t;
+      page<T, P, PS> *sibling = hdr.sibling_ptr;
+      if (belongs_right(sibling, key))
+        return (P)sibling;
 
       return NULL;
     } else { // internal node
+      // Leaf merges delete from internal nodes too. A scan that races with
+      // the shift may pair a key with the pointer moved in after it and
+      // route too far right, which the sibling links do not undo, so a
+      // scan that overlapped a writer is repeated.
       do {
         previous_switch_counter = hdr.switch_counter;
+        version = hdr.latch.version();
         ret = NULL;
 
         if (IS_FORWARD(previous_switch_counter)) {
-          if (key < (k = records[0].key)) {
-            if ((t = (P)hdr.leftmost_ptr) != records[0].ptr) {
-              ret = t;
-              continue;
-            }
-          }
-
-          for (i = 1; records[i].ptr != NULL; ++i) {
-            if (key < (k = records[i].key)) {
-              if ((t = records[i - 1].ptr) != records[i].ptr) {
-                ret = t;
-                break;
-              }
-            }
-          }
-
-          if (!ret) {
-            ret = records[i - 1].ptr;
-            continue;
+          if (binary_route(key, &t) || forward_scan(key, false, &t, &i)) {
+            ret = t;
+          } else {
+            ret = (i == 0) ? records[0].ptr : records[i - 1].ptr;
           }
         } else { // search from right to left
           for (i = count() - 1; i >= 0; --i) {
             if (key >= (k = records[i].key)) {
               if (i == 0) {
-                if ((P)hdr.leftmost_ptr != (t = records[i].ptr)) {
+                if (leftmost_slot() != (t = records[i].ptr)) {
                   ret = t;
                   break;
                 }
@@ -888,17 +1819,20 @@ public:
             }
           }
         }
-      } while (hdr.switch_counter != previous_switch_counter);
+      } while (hdr.switch_counter != previous_switch_counter ||
+               modified_since(version));
 
-      if ((t = (P)hdr.sibling_ptr) != NULL) {
-        if (key >= ((page<T, P> *)t)->records[0].key)
-          return t;
+      page<T, P, PS> *sibling = hdr.sibling_ptr;
+      if (sibling != NULL) {
+        if (key >= sibling->records[0].key)
+          return (P)sibling;
       }
 
+      // the child is handed out as a plain pointer
       if (ret) {
-        return ret;
+        return (P)slot_child(ret);
       } else
-        return (P)hdr.leftmost_ptr;
+        return (P)hdr.leftmost_ptr.get();
     }
 
     return NULL;
@@ -919,12 +1853,12 @@ public:
       printf("<-\n");
 
     if (hdr.leftmost_ptr != NULL)
-      printf("%x ", hdr.leftmost_ptr);
+      printf("%x ", hdr.leftmost_ptr.get());
 
     for (int i = 0; records[i].ptr != NULL; ++i)
       printf("%ld,%x ", records[i].key, records[i].ptr);
 
-    printf("%x ", hdr.sibling_ptr);
+    printf("%x ", hdr.sibling_ptr.get());
 
     printf("\n");
   }
@@ -936,46 +1870,375 @@ public:
     } else {
       printf("printing internal node: ");
       print();
-      ((page<T, P> *)hdr.leftmost_ptr)->printAll();
+      ((page<T, P, PS> *)hdr.leftmost_ptr)->printAll();
       for (int i = 0; records[i].ptr != NULL; ++i) {
-        ((page<T, P> *)records[i].ptr)->printAll();
+        slot_child(records[i].ptr)->printAll();
       }
     }
   }
 };
 
+template <class T, class P, int PS>
+constexpr int page<T, P, PS>::cardinality;
+
 // class page
 
+// Cursor over the tree in ascending key order, made by btree::lower_bound().
+// It holds a copy of one leaf at a time and moves right along the sibling
+// pointers, so results are streamed without an output buffer. Keys not
+// above the last one returned are skipped, which hides entries that a
+// concurrent split has copied into the next leaf.
+//
+//   for (auto it = bt->lower_bound(min).until(max).limit(n); it.valid();
+//        it.next())
+//     use(it.key(), it.value());
+template <class T, class P, int PS>
+class range_iterator {
+private:
+  epoch_guard guard; // the next leaf is not freed under the cursor
+  my_alloc::PMPool *pool;
+  T keys[page<T, P, PS>::cardinality];
+  P vals[page<T, P, PS>::cardinality];
+  int pos, n;
+  page<T, P, PS> *sibling;
+
+  T low; // keys must be above, or with low_inclusive at least, this
+  bool low_inclusive;
+  T high;
+  bool high_inclusive;
+  bool has_high;
+  size_t remaining;
+
+  inline bool above_low(const T &key) const {
+    return low < key || (low_inclusive && key == low);
+  }
+
+  inline bool below_high(const T &key) const {
+    return !has_high || key < high || (high_inclusive && key == high);
+  }
+
+  // Copy leaf, or the first leaf from it on with a key above the low bound
+  void load(page<T, P, PS> *leaf) {
+    pos = n = 0;
+    while (leaf != NULL) {
+      n = leaf->snapshot(keys, vals, &leaf);
+      for (pos = 0; pos < n && !above_low(keys[pos]); ++pos)
+        ;
+      if (pos < n) {
+        break;
+      }
+    }
+    sibling = leaf;
+  }
+
+public:
+  range_iterator(page<T, P, PS> *leaf, const T &min, bool inclusive)
+      : pool(my_alloc::CurrentPool()), low(min), low_inclusive(inclusive),
+        has_high(false), remaining(SIZE_MAX) {
+    load(leaf);
+  }
+
+  // End the scan at max, including it or not
+  range_iterator &until(const T &max, bool inclusive = true) {
+    high = max;
+    high_inclusive = inclusive;
+    has_high = true;
+    return *this;
+  }
+
+  // End the scan after n more results
+  range_iterator &limit(size_t n) {
+    remaining = n;
+    return *this;
+  }
+
+  bool valid() const {
+    return pos < n && remaining > 0 && below_high(keys[pos]);
+  }
+
+  const T &key() const { return keys[pos]; }
+  const P &value() const { return vals[pos]; }
+
+  void next() {
+    low = keys[pos];
+    low_inclusive = false;
+    --remaining;
+    if (++pos == n && remaining > 0 && below_high(keys[n - 1])) {
+      my_alloc::pool_scope scope(pool);
+      load(sibling);
+    }
+  }
+};
+
+// Cursor over the tree in descending key order, made by
+// btree::reverse_from(). Leaves are only linked to the right, so it keeps
+// a copy of the children of every internal node on its way down, and the
+// leaf before the current one is found from the parent's copy, going up
+// only when that is used up; per leaf this costs what a forward step does.
+// The copies may be stale, so a leaf is only taken once its sibling is
+// the current leaf or holds nothing left to return; otherwise the leaves
+// in between are visited first. A split that has not reached the parent
+// yet, or entries moved to a new leaf by a delete, are not skipped that
+// way, and keys not below the last one returned are never repeated.
+//
+//   for (auto it = bt->reverse_from(t, false).limit(n); it.valid();
+//        it.next())
+//     use(it.key(), it.value());
+template <class T, class P, int PS>
+class reverse_range_iterator {
+private:
+  typedef page<T, P, PS> node;
+
+  struct level {
+    node *children[node::cardinality + 1];
+    int n, pos; // children[pos] is on the path
+  };
+
+  epoch_guard guard; // nor are the nodes on the path and the chain
+  my_alloc::PMPool *pool;
+  T keys[node::cardinality];
+  P vals[node::cardinality];
+  int pos;
+  std::vector<level> path; // path[0] holds the parent of the leaves
+  std::vector<node *> chain; // leaves left to visit before the path's next
+  node *current;
+
+  T high; // keys must be below, or with high_inclusive at most, this
+  bool high_inclusive;
+  T low;
+  bool low_inclusive;
+  bool has_low;
+  size_t remaining;
+
+  inline bool below_high(const T &key) const {
+    return key < high || (high_inclusive && key == high);
+  }
+
+  inline bool above_low(const T &key) const {
+    return !has_low || low < key || (low_inclusive && key == low);
+  }
+
+  // True if leaf holds a key below the high bound
+  bool reaches_below(node *leaf) {
+    T first[node::cardinality];
+    P ptrs[node::cardinality];
+    node *sibling;
+    int n = leaf->snapshot(first, ptrs, &sibling);
+    return n > 0 && below_high(first[0]);
+  }
+
+  // The leaf left of the one the path leads to, or NULL at the left end
+  node *step_path() {
+    int l = 0;
+    while (l < (int)path.size() && path[l].pos == 0) {
+      ++l;
+    }
+    if (l == (int)path.size()) {
+      return NULL;
+    }
+    node *child = path[l].children[--path[l].pos];
+    T separators[node::cardinality];
+    while (l-- > 0) {
+      path[l].n = child->snapshot_children(path[l].children, separators);
+      path[l].pos = path[l].n - 1;
+      child = path[l].children[path[l].pos];
+    }
+    return child;
+  }
+
+  // Copy the next leaf, going left, that has a key below the high bound.
+  // A leaf whose sibling, as seen in its copy, is not the current leaf but
+  // holds keys below the bound waits until that sibling has been visited.
+  void load() {
+    pos = -1;
+    while (pos < 0) {
+      if (chain.empty()) {
+        node *leaf = step_path();
+        if (leaf == NULL) {
+          return;
+        }
+        chain.push_back(leaf);
+      }
+      node *leaf = chain.back();
+      node *sibling;
+      int n = leaf->snapshot(keys, vals, &sibling);
+      if (sibling != NULL && sibling != current && reaches_below(sibling)) {
+        chain.push_back(sibling);
+        continue;
+      }
+      chain.pop_back();
+      current = leaf;
+      for (pos = n - 1; pos >= 0 && !below_high(keys[pos]); --pos)
+        ;
+    }
+  }
+
+public:
+  reverse_range_iterator(node *root, const T &max, bool inclusive)
+      : pool(my_alloc::CurrentPool()), current(NULL), high(max),
+        high_inclusive(inclusive), has_low(false), remaining(SIZE_MAX) {
+    // descend to max, keeping the children of each node passed
+    path.resize(root->hdr.level);
+    node *child = root;
+    T separators[node::cardinality];
+    for (int l = root->hdr.level - 1; l >= 0; --l) {
+      int n = child->snapshot_children(path[l].children, separators);
+      T *end = separators + n - 1;
+      path[l].n = n;
+      path[l].pos = (inclusive ? std::upper_bound(separators, end, max)
+                               : std::lower_bound(separators, end, max)) -
+                    separators;
+      child = path[l].children[path[l].pos];
+    }
+    chain.push_back(child);
+    load();
+  }
+
+  // End the scan at min, including it or not
+  reverse_range_iterator &until(const T &min, bool inclusive = true) {
+    low = min;
+    low_inclusive = inclusive;
+    has_low = true;
+    return *this;
+  }
+
+  // End the scan after n more results
+  reverse_range_iterator &limit(size_t n) {
+    remaining = n;
+    return *this;
+  }
+
+  bool valid() const {
+    return pos >= 0 && remaining > 0 && above_low(keys[pos]);
+  }
+
+  const T &key() const { return keys[pos]; }
+  const P &value() const { return vals[pos]; }
+
+  void next() {
+    high = keys[pos];
+    high_inclusive = false;
+    --remaining;
+    if (--pos < 0 && remaining > 0 && above_low(high)) {
+      my_alloc::pool_scope scope(pool);
+      load();
+    }
+  }
+};
+
 /*
  * class btree
  */
-template<class T, class P>
-btree<T, P>::btree() {
+template <class T, class P, int PS>
+btree<T, P, PS>::btree() {
+  pool = my_alloc::CurrentPool();
   //root = (char *)new page();
-  page<T, P> *my_root;
-  my_alloc::BasePMPool::ZAllocate((void**)&my_root, sizeof(page<T, P>));
-  new (my_root) page<T, P>();
-  root = (char*)my_root;
+  page<T, P, PS> *my_root = page<T, P, PS>::allocate(0);
+  new (my_root) page<T, P, PS>();
+  root = my_root;
+#ifdef HYBRID_INDEX
+  first_leaf = my_root;
+  clflush((char *)&first_leaf, sizeof(first_leaf));
+#endif
   height = 1;
 }
 
-template<class T, class P>
-void btree<T, P>::setNewRoot(char *new_root) {
-  this->root = (char *)new_root;
-  clflush((char *)&(this->root), sizeof(char *));
+// The tree object and its nodes were written by an earlier process, and
+// the pool may now be mapped elsewhere; nodes link each other by pool
+// offsets, so nothing has to be rewritten for that. Only the root is fixed
+// up here; locks and the other nodes are repaired by their first writer,
+// so restart time depends on the height alone. With HYBRID_INDEX the
+// internal levels are rebuilt instead, in time linear in the leaves.
+template <class T, class P, int PS>
+btree<T, P, PS> *btree<T, P, PS>::reopen(void *addr) {
+  btree<T, P, PS> *bt = new (addr) btree<T, P, PS>(reopen_tag());
+  bt->pool = my_alloc::CurrentPool();
+  bt->recover();
+  return bt;
+}
+
+// Make an empty tree in pool and register it in the pool directory as
+// name, with the node size as its tag; NULL if the name is taken. A crash
+// before it is registered leaks the tree object and its root node.
+template <class T, class P, int PS>
+btree<T, P, PS> *btree<T, P, PS>::create(my_alloc::PMPool *pool,
+                                         const char *name) {
+  my_alloc::pool_scope scope(pool);
+  if (pool->FindTree(name) != NULL) {
+    return NULL;
+  }
+  btree<T, P, PS> *bt;
+  pool->ZAllocate((void **)&bt, sizeof(btree<T, P, PS>));
+  new (bt) btree<T, P, PS>();
+  clflush((char *)bt, sizeof(btree<T, P, PS>));
+  if (!pool->AddTree(name, bt, PS)) {
+    my_alloc::PageSlab<sizeof(page<T, P, PS>)>::Free(bt->root);
+    my_alloc::PMPool::Free(bt);
+    return NULL;
+  }
+  return bt;
+}
+
+// Reattach the tree registered in pool as name; NULL if there is none, or
+// it was made with another node size
+template <class T, class P, int PS>
+btree<T, P, PS> *btree<T, P, PS>::open(my_alloc::PMPool *pool,
+                                       const char *name) {
+  uint64_t tag;
+  void *addr = pool->FindTree(name, &tag);
+  if (addr == NULL || tag != PS) {
+    return NULL;
+  }
+  my_alloc::pool_scope scope(pool);
+  return reopen(addr);
+}
+
+template <class T, class P, int PS>
+void btree<T, P, PS>::recover() {
+#ifdef HYBRID_INDEX
+  // the DRAM levels, the root among them, went with the process
+  rebuild(0);
+#else
+  page<T, P, PS> *old_root = (page<T, P, PS> *)root;
+  old_root->lock();
+
+  // the root split, but the crash came before the new root was installed
+  page<T, P, PS> *sibling = old_root->hdr.sibling_ptr;
+  if (sibling != NULL) {
+    T split_key = (old_root->hdr.leftmost_ptr == NULL)
+                      ? sibling->records[sibling->first_slot()].key
+                      : old_root->records[old_root->hdr.last_index + 1].key;
+    page<T, P, PS> *new_root =
+        page<T, P, PS>::allocate(old_root->hdr.level + 1);
+    new (new_root) page<T, P, PS>(old_root, split_key, sibling,
+                                  old_root->hdr.level + 1);
+    setNewRoot((char *)new_root);
+  }
+
+  old_root->unlock();
+  height = ((page<T, P, PS> *)root)->hdr.level + 1;
+#endif
+}
+
+template <class T, class P, int PS>
+void btree<T, P, PS>::setNewRoot(char *new_root) {
+  this->root = (page<T, P, PS> *)new_root;
+  clflush((char *)&(this->root), sizeof(this->root));
   ++height;
 }
 
-template<class T, class P>
-P btree<T, P>::search(const T& key) const {
-  page<T, P> *p = (page<T, P> *)root;
+template <class T, class P, int PS>
+P btree<T, P, PS>::search(const T& key) const {
+  epoch_guard guard;
+  my_alloc::pool_scope scope(pool);
+  page<T, P, PS> *p = (page<T, P, PS> *)root;
 
   while (p->hdr.leftmost_ptr != NULL) {
-    p = (page<T, P> *)p->linear_search(key);
+    p = (page<T, P, PS> *)p->linear_search(key);
   }
 
-  page<T, P> *t;
-  while ((t = (page<T, P> *)p->linear_search(key)) == p->hdr.sibling_ptr) {
+  page<T, P, PS> *t;
+  while ((t = (page<T, P, PS> *)p->linear_search(key)) == p->hdr.sibling_ptr) {
     p = t;
     if (!p) {
       break;
@@ -990,48 +2253,156 @@ P btree<T, P>::search(const T& key) const {
   return (P)t;
 }
 
-// insert the key in the leaf node
-template<class T, class P>
-bool btree<T, P>::insert(const T& key, const P& right) { // need to be string
-  page<T, P> *p = (page<T, P> *)root;
+// Look up n keys into out, NULL for the missing ones. The lookups are
+// walked down in groups of MULTI_GET_GROUP, one node per lookup in turn,
+// and the next node of each is prefetched when it is found, so its cache
+// misses overlap with the work on the others in the group.
+template <class T, class P, int PS>
+void btree<T, P, PS>::multi_get(const T *keys, P *out, int n) const {
+  epoch_guard guard;
+  my_alloc::pool_scope scope(pool);
+  for (int base = 0; base < n; base += MULTI_GET_GROUP) {
+    int group = std::min(MULTI_GET_GROUP, n - base);
+    page<T, P, PS> *cur[MULTI_GET_GROUP];
+    for (int i = 0; i < group; ++i) {
+      cur[i] = (page<T, P, PS> *)root;
+    }
+
+    for (int active = group; active > 0;) {
+      active = 0;
+      for (int i = 0; i < group; ++i) {
+        page<T, P, PS> *p = cur[i];
+        if (p == NULL) {
+          continue;
+        }
+
+        page<T, P, PS> *next;
+        if (p->hdr.leftmost_ptr != NULL) {
+          next = (page<T, P, PS> *)p->linear_search(keys[base + i]);
+        } else {
+          // as in search(): the sibling pointer means the key moved right
+          P t = p->linear_search(keys[base + i]);
+          next = p->hdr.sibling_ptr;
+          if ((page<T, P, PS> *)t != next || next == NULL) {
+            out[base + i] = t;
+            cur[i] = NULL;
+            continue;
+          }
+        }
+        next->prefetch();
+        cur[i] = next;
+        ++active;
+      }
+    }
+  }
+}
+
+// insert the key in the leaf node; false if it is already in the tree, which
+// is then left as it is
+template <class T, class P, int PS>
+bool btree<T, P, PS>::insert(const T& key, const P& right) { // need to be string
+  epoch_guard guard;
+  my_alloc::pool_scope scope(pool);
+  page<T, P, PS> *p = (page<T, P, PS> *)root;
+
+  while (p->hdr.leftmost_ptr != NULL) {
+    p = (page<T, P, PS> *)p->linear_search(key);
+  }
+
+  bool existed = false;
+  if (!p->store(this, NULL, key, right, true, true, NULL, false,
+                &existed)) { // store
+    return insert(key, right);
+  }
+  return !existed;
+}
+
+// Give key a new value in place, without the two shifts of a delete and
+// an insert; false if the key is not in the tree
+template <class T, class P, int PS>
+bool btree<T, P, PS>::update(const T &key, const P &value) {
+  epoch_guard guard;
+  my_alloc::pool_scope scope(pool);
+  page<T, P, PS> *p = (page<T, P, PS> *)root;
+
+  while (p->hdr.leftmost_ptr != NULL) {
+    p = (page<T, P, PS> *)p->linear_search(key);
+  }
+
+  int ret = p->update(key, value);
+  if (ret < 0) {
+    return update(key, value);
+  }
+  return ret;
+}
+
+// Update key in place if it is in the tree, insert it otherwise
+template <class T, class P, int PS>
+void btree<T, P, PS>::upsert(const T &key, const P &value) {
+  epoch_guard guard;
+  my_alloc::pool_scope scope(pool);
+  page<T, P, PS> *p = (page<T, P, PS> *)root;
 
   while (p->hdr.leftmost_ptr != NULL) {
-    p = (page<T, P> *)p->linear_search(key);
+    p = (page<T, P, PS> *)p->linear_search(key);
+  }
+
+  if (!p->store(this, NULL, key, value, true, true, NULL, true)) {
+    upsert(key, value);
   }
+}
 
-  if (!p->store(this, NULL, key, right, true, true)) { // store
-    insert(key, right);
+// Insert a batch of keys: sorted first, so each leaf is reached by one
+// descent and takes all of its keys under one lock acquisition
+template <class T, class P, int PS>
+void btree<T, P, PS>::insert_batch(const V batch[], int n) {
+  epoch_guard guard;
+  my_alloc::pool_scope scope(pool);
+  std::vector<V> sorted(batch, batch + n);
+  std::sort(sorted.begin(), sorted.end(),
+            [](const V &a, const V &b) { return a.first < b.first; });
+
+  for (int i = 0; i < n;) {
+    page<T, P, PS> *p = (page<T, P, PS> *)root;
+    T bound;
+    bool bounded = false;
+    while (p->hdr.leftmost_ptr != NULL) {
+      p = p->route(sorted[i].first, &bound, &bounded);
+    }
+    i += p->store_batch(this, &sorted[i], n - i, bounded ? &bound : NULL);
   }
-  return true;
 }
 
 // store the key into the node at the given level
-template<class T, class P>
-void btree<T, P>::btree_insert_internal(char *left, T key, P right,
+template <class T, class P, int PS>
+void btree<T, P, PS>::btree_insert_internal(char *left, T key, P right,
                                   uint32_t level) {
-  if (level > ((page<T, P> *)root)->hdr.level)
+  if (level > ((page<T, P, PS> *)root)->hdr.level)
     return;
 
-  page<T, P> *p = (page<T, P> *)this->root;
+  page<T, P, PS> *p = (page<T, P, PS> *)this->root;
 
   while (p->hdr.level > level)
-    p = (page<T, P> *)p->linear_search(key);
+    p = (page<T, P, PS> *)p->linear_search(key);
 
-  if (!p->store(this, NULL, key, right, true, true)) {
+  if (!p->store(this, NULL, key, right, page<T, P, PS>::in_pool(level),
+                true)) {
     btree_insert_internal(left, key, right, level);
   }
 }
 
-template<class T, class P>
-void btree<T, P>::btree_delete(T key) {
-  page<T, P> *p = (page<T, P> *)root;
+template <class T, class P, int PS>
+void btree<T, P, PS>::btree_delete(T key) {
+  epoch_guard guard;
+  my_alloc::pool_scope scope(pool);
+  page<T, P, PS> *p = (page<T, P, PS> *)root;
 
   while (p->hdr.leftmost_ptr != NULL) {
-    p = (page<T, P> *)p->linear_search(key);
+    p = (page<T, P, PS> *)p->linear_search(key);
   }
 
-  page<T, P> *t;
-  while ((t = (page<T, P> *)p->linear_search(key)) == p->hdr.sibling_ptr) {
+  page<T, P, PS> *t;
+  while ((t = (page<T, P, PS> *)p->linear_search(key)) == p->hdr.sibling_ptr) {
     p = t;
     if (!p)
       break;
@@ -1040,30 +2411,116 @@ void btree<T, P>::btree_delete(T key) {
   if (p) {
     if (!p->remove(this, key)) {
       btree_delete(key);
+    } else if (p->count() < MERGE_FILL * page<T, P, PS>::cardinality) {
+      merge_leaves(key);
     }
   } else {
     printf("not found the key to delete %lu\n", key);
   }
 }
 
-template<class T, class P>
-void btree<T, P>::btree_delete_internal(T key, P ptr, uint32_t level,
+// Merge the leaf key belongs to with a neighbour under the same parent,
+// if the two fit in 1 - MERGE_FILL of a node; otherwise they are left as
+// they are. The parent, the left and the right leaf are locked in that
+// order, which no other writer reverses.
+//
+// The right leaf's entries are appended to the left one, the parent entry
+// of the right leaf is removed, and the left sibling pointer, stepping
+// over the right leaf, commits the merge as in FAIR. A crash before that
+// leaves the copies as the moved half of a split, which repair() cuts off
+// the left leaf, and the right leaf still reachable as its sibling. The
+// right leaf itself is never changed, only marked deleted, so readers
+// that are still inside it find its keys; it is freed once they are gone.
+template <class T, class P, int PS>
+void btree<T, P, PS>::merge_leaves(T key) {
+  page<T, P, PS> *parent = (page<T, P, PS> *)root;
+  if (parent->hdr.level == 0) {
+    return;
+  }
+  while (parent->hdr.level > 1) {
+    parent = (page<T, P, PS> *)parent->linear_search(key);
+  }
+
+  // the parent keeps at least one entry, as its first key is what its left
+  // sibling routes by
+  parent->lock();
+  page<T, P, PS> *sibling = parent->hdr.sibling_ptr;
+  int n = parent->count();
+  if (parent->hdr.is_deleted || n < 2 ||
+      (sibling && key >= sibling->records[0].key)) {
+    parent->unlock();
+    return;
+  }
+
+  // the leaf of key and the one before it, or the one after it if key is
+  // in the leftmost leaf; the right one is the child at slot
+  int slot = 0;
+  while (slot + 1 < n && parent->records[slot + 1].key <= key) {
+    ++slot;
+  }
+  page<T, P, PS> *left =
+      (slot == 0) ? parent->hdr.leftmost_ptr.get()
+                  : page<T, P, PS>::slot_child(parent->records[slot - 1].ptr);
+  page<T, P, PS> *right =
+      page<T, P, PS>::slot_child(parent->records[slot].ptr);
+
+  left->lock();
+  right->lock();
+  int left_num_entries = left->count();
+  int right_num_entries = right->count();
+  bool merged = false;
+  if (!left->hdr.is_deleted && !right->hdr.is_deleted &&
+      left->hdr.sibling_ptr == right &&
+      left_num_entries + right_num_entries <=
+          (1 - MERGE_FILL) * (page<T, P, PS>::cardinality - 1)) {
+    char *pending = NULL;
+    for (int i = 0; i < right_num_entries; ++i) {
+      left->insert_key(right->records[i].key, right->records[i].ptr,
+                       &left_num_entries, true, true, &pending);
+    }
+    left->flush_pending(&pending, NULL);
+#ifdef FINGERPRINT
+    left->update_fingerprints(left_num_entries, false, true);
+#endif
+
+    parent->remove_key(parent->records[slot].key,
+                       page<T, P, PS>::in_pool(parent->hdr.level));
+
+    left->hdr.sibling_ptr = right->hdr.sibling_ptr;
+    clflush((char *)&(left->hdr.sibling_ptr), sizeof(left->hdr.sibling_ptr));
+
+    right->hdr.is_deleted = 1;
+    clflush((char *)&(right->hdr.is_deleted), sizeof(uint8_t));
+    merged = true;
+  }
+  right->unlock();
+  left->unlock();
+  parent->unlock();
+
+  if (merged) {
+    epoch_retire(right, my_alloc::PageSlab<sizeof(page<T, P, PS>)>::Free,
+                 pool->serial);
+  }
+}
+
+template <class T, class P, int PS>
+void btree<T, P, PS>::btree_delete_internal(T key, P ptr, uint32_t level,
                                   T *deleted_key,
-                                  bool *is_leftmost_node, page<T, P> **left_sibling) {
-  if (level > ((page<T, P> *)this->root)->hdr.level)
+                                  bool *is_leftmost_node, page<T, P, PS> **left_sibling) {
+  if (level > ((page<T, P, PS> *)this->root)->hdr.level)
     return;
 
-  page<T, P> *p = (page<T, P> *)this->root;
+  page<T, P, PS> *p = (page<T, P, PS> *)this->root;
 
   while (p->hdr.level > level) {
-    p = (page<T, P> *)p->linear_search(key);
+    p = (page<T, P, PS> *)p->linear_search(key);
   }
 
-  p->hdr.mtx->lock();
+  p->lock();
 
-  if ((P)p->hdr.leftmost_ptr == ptr) {
+  if (p->leftmost_slot() == ptr) {
     *is_leftmost_node = true;
-    p->hdr.mtx->unlock();
+    p->unlock();
     return;
   }
 
@@ -1072,7 +2529,7 @@ void btree<T, P>::btree_delete_internal(T key, P ptr, uint32_t level,
   for (int i = 0; p->records[i].ptr != NULL; ++i) {
     if (p->records[i].ptr == ptr) {
       if (i == 0) {
-        if ((P)p->hdr.leftmost_ptr != p->records[i].ptr) {
+        if (p->leftmost_slot() != p->records[i].ptr) {
           *deleted_key = p->records[i].key;
           *left_sibling = p->hdr.leftmost_ptr;
           p->remove(this, *deleted_key, false, false);
@@ -1081,7 +2538,7 @@ void btree<T, P>::btree_delete_internal(T key, P ptr, uint32_t level,
       } else {
         if (p->records[i - 1].ptr != p->records[i].ptr) {
           *deleted_key = p->records[i].key;
-          *left_sibling = (page<T, P> *)p->records[i - 1].ptr;
+          *left_sibling = page<T, P, PS>::slot_child(p->records[i - 1].ptr);
           p->remove(this, *deleted_key, false, false);
           break;
         }
@@ -1089,45 +2546,260 @@ void btree<T, P>::btree_delete_internal(T key, P ptr, uint32_t level,
     }
   }
 
-  p->hdr.mtx->unlock();
+  p->unlock();
 }
 
-// Function to search keys from "min" to "max"
-template<class T, class P>
-void btree<T, P>::btree_search_range(T min, T max,
+// Function to search keys from "min" to "max". The values go to buf in key
+// order; the range iterator takes each leaf consistently, which a scan
+// racing with a merge could not do in place.
+template <class T, class P, int PS>
+void btree<T, P, PS>::btree_search_range(T min, T max,
                                unsigned long *buf) {
-  page<T, P> *p = (page<T, P> *)root;
+  int off = 0;
+  for (range_iterator<T, P, PS> it = lower_bound(min, false).until(max, false);
+       it.valid(); it.next()) {
+    buf[off++] = (unsigned long)it.value();
+  }
+}
 
-  while (p) {
-    if (p->hdr.leftmost_ptr != NULL) {
-      // The current page is internal
-      p = (page<T, P> *)p->linear_search(min);
-    } else {
-      // Found a leaf
-      p->linear_search_range(min, max, buf);
+// Position a cursor at the first key not below min, or above it when not
+// inclusive
+template <class T, class P, int PS>
+range_iterator<T, P, PS> btree<T, P, PS>::lower_bound(const T &min,
+                                                      bool inclusive) {
+  epoch_guard guard;
+  my_alloc::pool_scope scope(pool);
+  page<T, P, PS> *p = (page<T, P, PS> *)root;
+  while (p->hdr.leftmost_ptr != NULL) {
+    p = (page<T, P, PS> *)p->linear_search(min);
+  }
+  return range_iterator<T, P, PS>(p, min, inclusive);
+}
 
-      break;
+// Position a descending cursor at the last key not above max, or below it
+// when not inclusive
+template <class T, class P, int PS>
+reverse_range_iterator<T, P, PS>
+btree<T, P, PS>::reverse_from(const T &max, bool inclusive) {
+  epoch_guard guard;
+  my_alloc::pool_scope scope(pool);
+  return reverse_range_iterator<T, P, PS>((page<T, P, PS> *)root, max,
+                                          inclusive);
+}
+
+template <class T, class P, int PS>
+void btree<T, P, PS>::bulk_load(const V arr[], int num) {
+  bulk_load(arr, num, BULK_LOAD_FILL);
+}
+
+// Build the tree bottom-up from strictly ascending input into an empty
+// tree. Leaves are packed to the fill factor and each level above is built
+// from the first keys of the level below; the nodes of a level are spread
+// evenly so none is left nearly empty. Nodes are written back as they are
+// finished, and the slab bitmap once per word of slots they take, but
+// fenced only once per builder, before the root is published with a single
+// 8-byte store: until then nothing can reach them, and a crash leaves the
+// empty tree, with at worst the slots of its nodes leaked. Other input, or a tree that already holds
+// keys, is inserted key by key. The tree must not be used concurrently.
+//
+// Each level is cut into contiguous runs of nodes, built on up to
+// n_threads threads (0: one per core), that are stitched together by their
+// sibling pointers afterwards. Levels too small to share out, the top ones
+// in particular, are built by the calling thread alone.
+template <class T, class P, int PS>
+void btree<T, P, PS>::bulk_load(const V arr[], int num, double fill,
+                                int n_threads) {
+  typedef page<T, P, PS> node;
+  my_alloc::pool_scope scope(pool);
+  node *old_root = root;
+
+  bool bottom_up = num > 0 && old_root->hdr.leftmost_ptr == NULL &&
+                   old_root->records[0].ptr == NULL &&
+                   old_root->hdr.sibling_ptr == NULL;
+  for (int i = 1; bottom_up && i < num; ++i) {
+    bottom_up = arr[i - 1].first < arr[i].first;
+  }
+  if (!bottom_up) {
+    for (int i = 0; i < num; i++) {
+      insert(arr[i].first, arr[i].second);
+    }
+    return;
+  }
+
+  if (n_threads <= 0) {
+    n_threads = std::max(1u, std::thread::hardware_concurrency());
+  }
+
+  // at least two entries, so every internal node has a key to route by
+  int per_node = std::max(
+      2, std::min(node::cardinality - 1, (int)(fill * (node::cardinality - 1))));
+
+  // the nodes of the level just built and the smallest key below each
+  std::vector<node *> nodes;
+  std::vector<T> low_keys;
+
+  // leaves
+  int n_nodes = (num + per_node - 1) / per_node;
+  build_level(n_nodes, [&](int j) {
+    long from = (long)num * j / n_nodes, to = (long)num * (j + 1) / n_nodes;
+    node *leaf = node::allocate(0, true);
+    new (leaf) node(0);
+    leaf->bulk_fill(NULL, to - from, [&](int i) { return arr[from + i]; });
+    low_keys[j] = arr[from].first;
+    return leaf;
+  }, nodes, low_keys, n_threads);
+#ifdef HYBRID_INDEX
+  node *chain = nodes[0]; // nodes holds the upper levels next
+#endif
+
+  uint32_t level;
+  node *new_root = build_index(nodes, low_keys, per_node, n_threads, &level);
+
+  persist_fence();
+#ifdef HYBRID_INDEX
+  // rebuild() walks the chain from here, so it is published only once
+  // the leaves and their sibling links are durable
+  first_leaf = chain;
+  flush_lines(&first_leaf, sizeof(first_leaf));
+#endif
+  root = new_root;
+  clflush((char *)&root, sizeof(root));
+  height = level + 1;
+
+  // a reader may still be in the empty root
+  epoch_retire(old_root, my_alloc::PageSlab<sizeof(node)>::Free,
+               pool->serial);
+}
+
+// Build the n_nodes nodes of a level into nodes; make(j) allocates and
+// fills node j and sets low_keys[j], its smallest key
+template <class T, class P, int PS>
+void btree<T, P, PS>::build_level(
+    int n_nodes, const std::function<page<T, P, PS> *(int)> &make,
+    std::vector<page<T, P, PS> *> &nodes, std::vector<T> &low_keys,
+    int n_threads) {
+  typedef page<T, P, PS> node;
+  const int min_nodes_per_thread = 256;
+  nodes.assign(n_nodes, NULL);
+  low_keys.assign(n_nodes, T());
+  int runs = std::max(1, std::min(n_threads, n_nodes / min_nodes_per_thread));
+
+  // the last node of a run is written back once it is stitched
+  auto build_run = [&](int from, int to) {
+    my_alloc::pool_scope scope(pool);
+    for (int j = from; j < to; ++j) {
+      nodes[j] = make(j);
+      if (j > from) {
+        nodes[j - 1]->hdr.sibling_ptr = nodes[j];
+        if (node::in_pool(nodes[j]->hdr.level)) {
+          flush_lines(nodes[j - 1], sizeof(node));
+        }
+      }
+    }
+    my_alloc::PageSlab<sizeof(node)>::Sync();
+    persist_fence();
+  };
+
+  std::vector<std::future<void>> futures;
+  for (int r = 1; r < runs; ++r) {
+    futures.push_back(std::async(std::launch::async, build_run,
+                                 (long)n_nodes * r / runs,
+                                 (long)n_nodes * (r + 1) / runs));
+  }
+  build_run(0, n_nodes / runs);
+  for (auto &f : futures) {
+    f.get();
+  }
+
+  for (int r = 1; r <= runs; ++r) {
+    int last = (long)n_nodes * r / runs - 1;
+    if (r < runs) {
+      nodes[last]->hdr.sibling_ptr = nodes[last + 1];
+    }
+    if (node::in_pool(nodes[last]->hdr.level)) {
+      flush_lines(nodes[last], sizeof(node));
     }
   }
 }
 
-template<class T, class P>
-void btree<T, P>::bulk_load(const V arr[], int num) {
-  for (int i = 0; i < num; i++)
-  {
-    /* code */
-    insert(arr[i].first, arr[i].second);
+// Build the internal levels over nodes, whose smallest keys are low_keys,
+// each node taking per_node + 1 children; returns the root and its level.
+// Nodes are written back but not fenced.
+template <class T, class P, int PS>
+page<T, P, PS> *btree<T, P, PS>::build_index(
+    std::vector<page<T, P, PS> *> &nodes, std::vector<T> &low_keys,
+    int per_node, int n_threads, uint32_t *level) {
+  typedef page<T, P, PS> node;
+  std::vector<node *> children;
+  std::vector<T> child_keys;
+  *level = 0;
+  while (nodes.size() > 1) {
+    uint32_t l = ++*level;
+    nodes.swap(children);
+    low_keys.swap(child_keys);
+    int count = children.size();
+    int n_nodes = (count + per_node) / (per_node + 1);
+    build_level(n_nodes, [&](int j) {
+      long from = (long)count * j / n_nodes,
+           to = (long)count * (j + 1) / n_nodes;
+      node *parent = node::allocate(l, true);
+      new (parent) node(l);
+      parent->bulk_fill(children[from], to - from - 1, [&](int i) {
+        return std::make_pair(child_keys[from + 1 + i],
+                              node::child_slot(children[from + 1 + i]));
+      });
+      low_keys[j] = child_keys[from];
+      return parent;
+    }, nodes, low_keys, n_threads);
   }
+  return nodes[0];
+}
+
+#ifdef HYBRID_INDEX
+// Put the internal levels back in DRAM over the leaf chain, on n_threads
+// threads (0: one per core). The chain is walked once, which is where the
+// time goes; the levels above are built in parallel like bulk_load()'s.
+// A leaf that is empty, or whose first key does not follow the last one
+// taken, is left out; it is still reached through its left sibling, like
+// the new half of a split that has not reached the parent.
+template <class T, class P, int PS>
+void btree<T, P, PS>::rebuild(int n_threads) {
+  typedef page<T, P, PS> node;
+  if (n_threads <= 0) {
+    n_threads = std::max(1u, std::thread::hardware_concurrency());
+  }
+
+  std::vector<node *> nodes;
+  std::vector<T> low_keys;
+  node *leaf = first_leaf;
+  nodes.push_back(leaf);
+  low_keys.push_back(T());
+  for (leaf = leaf->hdr.sibling_ptr; leaf != NULL;
+       leaf = leaf->hdr.sibling_ptr) {
+    int low = leaf->first_slot();
+    if (leaf->records[low].ptr != NULL &&
+        (nodes.size() == 1 || low_keys.back() < leaf->records[low].key)) {
+      nodes.push_back(leaf);
+      low_keys.push_back(leaf->records[low].key);
+    }
+  }
+
+  int per_node = std::max(2, (int)(BULK_LOAD_FILL * (node::cardinality - 1)));
+  uint32_t level;
+  root = build_index(nodes, low_keys, per_node, n_threads, &level);
+  height = level + 1;
 }
+#endif
 
-template<class T, class P>
-void btree<T, P>::printAll() {
+template <class T, class P, int PS>
+void btree<T, P, PS>::printAll() {
+  my_alloc::pool_scope scope(pool);
   pthread_mutex_lock(&print_mtx);
   int total_keys = 0;
-  page<T, P> *leftmost = (page<T, P> *)root;
-  printf("root: %x\n", root);
+  page<T, P, PS> *leftmost = (page<T, P, PS> *)root;
+  printf("root: %x\n", root.get());
   do {
-    page<T, P> *sibling = leftmost;
+    page<T, P, PS> *sibling = leftmost;
     while (sibling) {
       if (sibling->hdr.level == 0) {
         total_keys += sibling->hdr.last_index + 1;
@@ -12,62 +12,113 @@ void clear_cache() {
   delete[] garbage;
 }
 
-// MAIN
-int main(int argc, char **argv) {
-  // Parsing arguments
-  int numData = 0;
-  int n_threads = 1;
-  //char *input_path = (char *)std::string("../sample_input.txt").data();
-  //intialize the memory pool
-  my_alloc::BasePMPool::Initialize(pool_name, pool_size);
-  int c;
-  while ((c = getopt(argc, argv, "n:w:t:i:")) != -1) {
-    switch (c) {
-    case 'n':
-      numData = atoi(optarg);
-      break;
-    case 't':
-      n_threads = atoi(optarg);
-    default:
-      break;
-    }
-  }
-
-  btree<int64_t, char*> *bt;
-  bt = reinterpret_cast<btree<int64_t, char*>*>(my_alloc::BasePMPool::GetRoot(sizeof(btree<int64_t, char*>)));
-  new (bt) btree<int64_t, char*>();
+// Report the flushes and fences issued per operation since the last
+// report, and start counting afresh
+void print_persist_stats(long ops) {
+  persist_stats s = read_persist_stats();
+  cout << "Flushes per op = " << (double)s.flushes / ops
+       << ", fences per op = " << (double)s.fences / ops << endl;
+  reset_persist_stats();
+}
 
-  struct timespec start, end, tmp;
+// How run() drives the tree, from the command line
+struct bench_options {
+  int n_threads;
+  bool bulk;      // -b: warm up with bulk_load
+  int batch;      // -B: keys per insert_batch call, 0 to insert one by one
+  bool multi_get; // -m: search through multi_get
+  bool update;    // -u: also time updating the warm-up keys in place
+  bool crash;     // -x: leave the leaves as a crash in an insert can
+};
+
+// Leave every leaf with room as a crash in an insert in front of its first
+// key can: the entries shifted one slot to the right and slot 0 with a NULL
+// pointer, which the first visit after a restart has to repair. A later -r
+// run on the kept pool checks that no key was lost.
+struct crash_test {
+  template <int PS>
+  static void plant_gaps(btree<int64_t, char *, PS> *bt) {
+    typedef page<int64_t, char *, PS> node;
+    node *leaf = (node *)bt->root;
+    while (leaf->hdr.leftmost_ptr != NULL) {
+      leaf = leaf->hdr.leftmost_ptr;
+    }
 
-  // Reading data
-  int64_t *keys = new int64_t[numData];
+    long planted = 0;
+    for (; leaf != NULL; leaf = leaf->hdr.sibling_ptr) {
+      int n = leaf->count();
+      if (n == 0 || n + 2 > node::cardinality) {
+        continue;
+      }
+      leaf->records[n + 1].ptr = NULL;
+      for (int i = n - 1; i >= 0; --i) {
+        leaf->records[i + 1].ptr = leaf->records[i].ptr;
+        leaf->records[i + 1].key = leaf->records[i].key;
+      }
+      leaf->records[0].ptr = NULL;
+      clflush((char *)leaf, sizeof(node));
+      ++planted;
+    }
+    cout << "Left " << planted << " leaves with a NULL first slot" << endl;
+  }
+};
 
-  unsigned long long init[4]={0x12345ULL, 0x23456ULL, 0x34567ULL, 0x45678ULL}, length=4;
-  init_by_array64(init, length);
+// Each node size in a -s list gets a tree of its own in the pool, under
+// this name, so none of them is lost and -r can reattach every one
+std::string tree_name(int node_size) {
+  return "fast-fair-" + std::to_string(node_size);
+}
 
-  for(int i = 0; i < numData; ++i){
-    keys[i] = genrand64_int64();
+// Run the benchmark on a fresh tree whose nodes are PS bytes
+template <int PS>
+void run(int64_t *keys, int numData, const bench_options &opt) {
+  int n_threads = opt.n_threads;
+  cout << "Node size: " << PS << " bytes, "
+       << page<int64_t, char *, PS>::cardinality << " entries" << endl;
+
+  btree<int64_t, char *, PS> *bt = btree<int64_t, char *, PS>::create(
+      my_alloc::CurrentPool(), tree_name(PS).c_str());
+  if (bt == NULL) {
+    cout << "the pool already holds a tree named " << tree_name(PS) << endl;
+    return;
   }
 
+  struct timespec start, end, tmp;
+
   // Initializing stats
-  clflush_cnt = 0;
+  reset_persist_stats();
   search_time_in_insert = 0;
   clflush_time_in_insert = 0;
   gettime_cnt = 0;
 
-  clock_gettime(CLOCK_MONOTONIC, &start);
-
   long half_num_data = numData / 2;
 
+  // -b loads the warm-up half, sorted, with bulk_load instead
+  vector<pair<int64_t, char *>> sorted;
+  if (opt.bulk) {
+    for (int i = 0; i < half_num_data; ++i) {
+      sorted.push_back(make_pair(keys[i], (char *)keys[i]));
+    }
+    sort(sorted.begin(), sorted.end());
+  }
+
+  clock_gettime(CLOCK_MONOTONIC, &start);
+
   // Warm-up! Insert half of input size
-  for (int i = 0; i < half_num_data; ++i) {
-    bt->insert(keys[i], (char *)keys[i]);
+  if (opt.bulk) {
+    bt->bulk_load(sorted.data(), half_num_data, BULK_LOAD_FILL, n_threads);
+  } else {
+    for (int i = 0; i < half_num_data; ++i) {
+      bt->insert(keys[i], (char *)keys[i]);
+    }
   }
   cout << "Warm-up!" << endl;
 
   clock_gettime(CLOCK_MONOTONIC, &end);
   long long elapsedTime =
       (end.tv_sec - start.tv_sec) * 1000000000 + (end.tv_nsec - start.tv_nsec);
+  cout << "Warm-up (usec) : " << elapsedTime / 1000 << endl;
+  print_persist_stats(half_num_data);
 
   clear_cache();
 
@@ -85,9 +136,15 @@ int main(int argc, char **argv) {
     int to = (tid == n_threads - 1) ? half_num_data : from + data_per_thread;
 
     auto f = async(launch::async,
-                   [&bt, &keys](int from, int to) {
-                     for (int i = from; i < to; ++i)
-                       bt->search(keys[i]);
+                   [&bt, &keys, &opt](int from, int to) {
+                     if (!opt.multi_get) {
+                       for (int i = from; i < to; ++i)
+                         bt->search(keys[i]);
+                       return;
+                     }
+                     char *out[1024];
+                     for (int i = from; i < to; i += 1024)
+                       bt->multi_get(&keys[i], out, min(1024, to - i));
                    },
                    from, to);
     futures.push_back(move(f));
@@ -102,11 +159,13 @@ int main(int argc, char **argv) {
   cout << "Concurrent searching with " << n_threads
        << " threads (usec) : " << elapsedTime / 1000 << endl;
   cout << "Throughput = " << (double)half_num_data / ((double)elapsedTime / (1000UL*1000*1000)) << "Mops/s" << std::endl;
+  print_persist_stats(half_num_data);
 
   clear_cache();
   futures.clear();
 
   // Insert
+  int batch = opt.batch;
   clock_gettime(CLOCK_MONOTONIC, &start);
 
   for (int tid = 0; tid < n_threads; tid++) {
@@ -114,9 +173,20 @@ int main(int argc, char **argv) {
     int to = (tid == n_threads - 1) ? numData : from + data_per_thread;
 
     auto f = async(launch::async,
-                   [&bt, &keys](int from, int to) {
-                     for (int i = from; i < to; ++i)
-                       bt->insert(keys[i], (char *)keys[i]);
+                   [&bt, &keys, batch](int from, int to) {
+                     if (batch == 0) {
+                       for (int i = from; i < to; ++i)
+                         bt->insert(keys[i], (char *)keys[i]);
+                       return;
+                     }
+                     // -B inserts through insert_batch, batch keys a call
+                     vector<pair<int64_t, char *>> v;
+                     for (int i = from; i < to; i += batch) {
+                       v.clear();
+                       for (int j = i; j < to && j < i + batch; ++j)
+                         v.push_back(make_pair(keys[j], (char *)keys[j]));
+                       bt->insert_batch(v.data(), v.size());
+                     }
                    },
                    from, to);
     futures.push_back(move(f));
@@ -131,6 +201,39 @@ int main(int argc, char **argv) {
   cout << "Concurrent inserting with " << n_threads
        << " threads (usec) : " << elapsedTime / 1000 << endl;
   cout << "Throughput = " << (double)half_num_data / ((double)elapsedTime / (1000UL*1000*1000)) << "Mops/s" << std::endl;
+  print_persist_stats(half_num_data);
+
+  if (opt.update) {
+    clear_cache();
+    futures.clear();
+
+    // Update
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    for (int tid = 0; tid < n_threads; tid++) {
+      int from = data_per_thread * tid;
+      int to = (tid == n_threads - 1) ? half_num_data : from + data_per_thread;
+
+      auto f = async(launch::async,
+                     [&bt, &keys](int from, int to) {
+                       for (int i = from; i < to; ++i)
+                         bt->update(keys[i], (char *)keys[i] + 1);
+                     },
+                     from, to);
+      futures.push_back(move(f));
+    }
+    for (auto &&f : futures)
+      if (f.valid())
+        f.get();
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    elapsedTime =
+        (end.tv_sec - start.tv_sec) * 1000000000 + (end.tv_nsec - start.tv_nsec);
+    cout << "Concurrent updating with " << n_threads
+         << " threads (usec) : " << elapsedTime / 1000 << endl;
+    cout << "Throughput = " << (double)half_num_data / ((double)elapsedTime / (1000UL*1000*1000)) << "Mops/s" << std::endl;
+    print_persist_stats(half_num_data);
+  }
 
 #else
   clock_gettime(CLOCK_MONOTONIC, &start);
@@ -190,10 +293,164 @@ int main(int argc, char **argv) {
   cout << "Concurrent inserting and searching with " << n_threads
        << " threads (usec) : " << elapsedTime / 1000 << endl;
   cout << "Throughput = " << (double)half_num_data / ((double)elapsedTime / (1000UL*1000*1000)) << "Mops/s" << std::endl;
+  print_persist_stats(half_num_data);
 #endif
 
+  if (opt.crash) {
+    crash_test::plant_gaps(bt);
+  }
+}
+
+// Reattach the tree of PS-byte nodes a previous run left in the pool and
+// look up the keys its warm-up inserted
+template <int PS>
+void recover(int64_t *keys, int numData) {
+  struct timespec start, end;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  btree<int64_t, char *, PS> *bt = btree<int64_t, char *, PS>::open(
+      my_alloc::CurrentPool(), tree_name(PS).c_str());
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  if (bt == NULL) {
+    cout << "no tree named " << tree_name(PS) << " to recover in the pool"
+         << endl;
+    return;
+  }
+  long long elapsedTime =
+      (end.tv_sec - start.tv_sec) * 1000000000 + (end.tv_nsec - start.tv_nsec);
+  cout << "Node size: " << PS << " bytes, recovered in (usec) : "
+       << elapsedTime / 1000 << endl;
+
+  long half_num_data = numData / 2;
+  long found = 0;
+  for (int i = 0; i < half_num_data; ++i) {
+    if (bt->search(keys[i]) == (char *)keys[i]) {
+      ++found;
+    }
+  }
+  cout << "Found " << found << " of " << half_num_data << " warm-up keys"
+       << endl;
+}
+
+// Run the benchmark for PS-byte nodes, or with -r check the tree an
+// earlier run left for them
+template <int PS>
+void bench(int64_t *keys, int numData, const bench_options &opt,
+           bool recovery) {
+  if (recovery) {
+    recover<PS>(keys, numData);
+  } else {
+    run<PS>(keys, numData, opt);
+  }
+}
+
+// MAIN
+int main(int argc, char **argv) {
+  // Parsing arguments
+  int numData = 0;
+  bench_options opt = {1, false, 0, false, false, false};
+  bool recovery = false;
+  std::string node_sizes = "512";
+  my_alloc::pool_options pool;
+  //char *input_path = (char *)std::string("../sample_input.txt").data();
+  cout << "Flush instruction: " << flush_insn_names[flush_insn] << endl;
+  int c;
+  while ((c = getopt(argc, argv, "n:w:t:i:s:rbB:mup:z:a:kx")) != -1) {
+    switch (c) {
+    case 'n':
+      numData = atoi(optarg);
+      break;
+    case 'w':
+      parse_nvm_model(optarg);
+      break;
+    case 't':
+      opt.n_threads = atoi(optarg);
+      break;
+    case 's':
+      node_sizes = optarg;
+      break;
+    case 'r':
+      recovery = true;
+      break;
+    case 'b':
+      opt.bulk = true;
+      break;
+    case 'B':
+      opt.batch = atoi(optarg);
+      break;
+    case 'm':
+      opt.multi_get = true;
+      break;
+    case 'u':
+      opt.update = true;
+      break;
+    case 'p':
+      pool.path = optarg;
+      break;
+    case 'z': // GB
+      pool.size = strtoull(optarg, NULL, 10) << 30;
+      break;
+    case 'a':
+      pool.addr = strtoull(optarg, NULL, 16);
+      break;
+    case 'k':
+      pool.keep = true;
+      break;
+    case 'x':
+      opt.crash = true;
+      break;
+    default:
+      break;
+    }
+  }
+
+  //intialize the memory pool
+  my_alloc::BasePMPool::Initialize(pool);
+
+  // Reading data
+  int64_t *keys = new int64_t[numData];
+
+  unsigned long long init[4]={0x12345ULL, 0x23456ULL, 0x34567ULL, 0x45678ULL}, length=4;
+  init_by_array64(init, length);
+
+  for(int i = 0; i < numData; ++i){
+    keys[i] = genrand64_int64();
+  }
+
+  // -s takes a comma separated list of node sizes, e.g. -s 256,512,4096;
+  // strtok writes into what it splits, so it is given a copy. -r checks
+  // the trees of an earlier, possibly killed, run for those sizes instead.
+  std::vector<char> sizes(node_sizes.begin(), node_sizes.end());
+  sizes.push_back('\0');
+  for (char *size = strtok(sizes.data(), ","); size != NULL;
+       size = strtok(NULL, ",")) {
+    switch (atoi(size)) {
+    case 256:
+      bench<256>(keys, numData, opt, recovery);
+      break;
+    case 512:
+      bench<512>(keys, numData, opt, recovery);
+      break;
+    case 1024:
+      bench<1024>(keys, numData, opt, recovery);
+      break;
+    case 2048:
+      bench<2048>(keys, numData, opt, recovery);
+      break;
+    case 4096:
+      bench<4096>(keys, numData, opt, recovery);
+      break;
+    default:
+      cout << "unsupported node size: " << size << endl;
+      break;
+    }
+    if (!recovery) {
+      clear_cache();
+    }
+  }
+
   //delete bt;
   delete[] keys;
+  my_alloc::BasePMPool::ClosePool();
 
   return 0;
 }
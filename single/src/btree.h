@@ -25,10 +25,10 @@
 #include <time.h>
 #include <unistd.h>
 #include <vector>
+#include "persist.h"
 
 #define PAGESIZE 512
 
-#define CPU_FREQ_MHZ (1994)
 #define DELAY_IN_NS (1000)
 #define CACHE_LINE_SIZE 64
 #define QUERY_NUM 25
@@ -37,44 +37,14 @@
 
 using entry_key_t = int64_t;
 
-static inline void cpu_pause() { __asm__ volatile("pause" ::: "memory"); }
-
-static inline unsigned long read_tsc(void) {
-  unsigned long var;
-  unsigned int hi, lo;
-
-  asm volatile("rdtsc" : "=a"(lo), "=d"(hi));
-  var = ((unsigned long long int)hi << 32) | lo;
-
-  return var;
-}
-
-unsigned long write_latency_in_ns = 0;
 unsigned long long search_time_in_insert = 0;
 unsigned int gettime_cnt = 0;
 unsigned long long clflush_time_in_insert = 0;
 unsigned long long update_time_in_insert = 0;
-int clflush_cnt = 0;
 int node_cnt = 0;
 
 using namespace std;
 
-inline void mfence() { asm volatile("mfence" ::: "memory"); }
-
-inline void clflush(char *data, int len) {
-  volatile char *ptr = (char *)((unsigned long)data & ~(CACHE_LINE_SIZE - 1));
-  mfence();
-  for (; ptr < data + len; ptr += CACHE_LINE_SIZE) {
-    unsigned long etsc =
-        read_tsc() + (unsigned long)(write_latency_in_ns * CPU_FREQ_MHZ / 1000);
-    asm volatile("clflush %0" : "+m"(*(volatile char *)ptr));
-    while (read_tsc() < etsc)
-      cpu_pause();
-    //++clflush_cnt;
-  }
-  mfence();
-}
-
 class page;
 
 class btree {
@@ -85,7 +55,7 @@ private:
 public:
   btree();
   void setNewRoot(char *);
-  void btree_insert(entry_key_t, char *);
+  bool btree_insert(entry_key_t, char *, bool upsert = false);
   void btree_insert_internal(char *, entry_key_t, char *, uint32_t);
   void btree_delete(entry_key_t);
   void btree_delete_internal(entry_key_t, char *, uint32_t, entry_key_t *,
@@ -489,20 +459,54 @@ public:
     ++(*num_entries);
   }
 
-  // Insert a new key - FAST and FAIR
+  // Slot of key among the first n entries of this leaf, -1 if it is not
+  // there. No shift is under way during a store, so the keys are in order.
+  inline int find_key(entry_key_t key, int n) {
+    int lo = 0, hi = n;
+    while (lo < hi) {
+      int mid = (lo + hi) / 2;
+      if (records[mid].key < key) {
+        lo = mid + 1;
+      } else {
+        hi = mid;
+      }
+    }
+    return (lo < n && records[lo].key == key) ? lo : -1;
+  }
+
+  // Insert a new key - FAST and FAIR. A key already in the leaf is not
+  // inserted again: *existed is set and, with upsert, its value is
+  // overwritten in place instead.
   page *store(btree *bt, char *left, entry_key_t key, char *right, bool flush,
-              page *invalid_sibling = NULL) {
+              page *invalid_sibling = NULL, bool upsert = false,
+              bool *existed = NULL) {
     // If this node has a sibling node,
     if (hdr.sibling_ptr && (hdr.sibling_ptr != invalid_sibling)) {
-      // Compare this key with the first key of the sibling
-      if (key > hdr.sibling_ptr->records[0].key) {
+      // Compare this key with the first key of the sibling; in a leaf an
+      // equal key is the sibling's
+      entry_key_t first = hdr.sibling_ptr->records[0].key;
+      if (key > first || (key == first && hdr.leftmost_ptr == NULL)) {
         return hdr.sibling_ptr->store(bt, NULL, key, right, true,
-                                      invalid_sibling);
+                                      invalid_sibling, upsert, existed);
       }
     }
 
     register int num_entries = count();
 
+    if (hdr.leftmost_ptr == NULL) {
+      int i = find_key(key, num_entries);
+      if (i >= 0) {
+        if (upsert) {
+          records[i].ptr = right;
+          clflush((char *)&records[i].ptr, sizeof(char *));
+        }
+        if (existed) {
+          *existed = true;
+        }
+        return this;
+      }
+    }
+
     // FAST
     if (num_entries < cardinality - 1) {
       insert_key(key, right, &num_entries, flush);
@@ -581,6 +585,7 @@ public:
     page *current = this;
 
     while (current) {
+      emulate_nvm_read(); // each leaf of the scan is a node visit
       int old_off = off;
       do {
         previous_switch_counter = current->hdr.switch_counter;
@@ -659,6 +664,8 @@ public:
     char *t;
     entry_key_t k;
 
+    emulate_nvm_read();
+
     if (hdr.leftmost_ptr == NULL) { // Search a leaf node
       do {
         previous_switch_counter = hdr.switch_counter;
@@ -854,17 +861,22 @@ char *btree::btree_search(entry_key_t key) {
   return (char *)t;
 }
 
-// insert the key in the leaf node
-void btree::btree_insert(entry_key_t key, char *right) { // need to be string
+// insert the key in the leaf node; false if it is already in the tree, in
+// which case only upsert overwrites its value
+bool btree::btree_insert(entry_key_t key, char *right,
+                         bool upsert) { // need to be string
   page *p = (page *)root;
 
   while (p->hdr.leftmost_ptr != NULL) {
     p = (page *)p->linear_search(key);
   }
 
-  if (!p->store(this, NULL, key, right, true)) { // store
-    btree_insert(key, right);
+  bool existed = false;
+  if (!p->store(this, NULL, key, right, true, NULL, upsert,
+                &existed)) { // store
+    return btree_insert(key, right, upsert);
   }
+  return !existed;
 }
 
 // store the key into the node at the given level
@@ -11,6 +11,15 @@ void clear_cache() {
   delete[] garbage;
 }
 
+// Report the flushes and fences issued per operation since the last
+// report, and start counting afresh
+void print_persist_stats(long ops) {
+  persist_stats s = read_persist_stats();
+  cout << "Flushes per op = " << (double)s.flushes / ops
+       << ", fences per op = " << (double)s.fences / ops << endl;
+  reset_persist_stats();
+}
+
 // MAIN
 int main(int argc, char **argv) {
   // Parsing arguments
@@ -26,7 +35,7 @@ int main(int argc, char **argv) {
       num_data = atoi(optarg);
       break;
     case 'w':
-      write_latency_in_ns = atol(optarg);
+      parse_nvm_model(optarg);
       break;
     case 't':
       n_threads = atoi(optarg);
@@ -40,6 +49,8 @@ int main(int argc, char **argv) {
     }
   }
 
+  cout << "Flush instruction: " << flush_insn_names[flush_insn] << endl;
+
   btree *bt;
   bt = new btree();
 
@@ -63,6 +74,7 @@ int main(int argc, char **argv) {
   ifs.close();
 
   {
+    reset_persist_stats();
     clock_gettime(CLOCK_MONOTONIC, &start);
 
     for (int i = 0; i < num_data; ++i) {
@@ -77,6 +89,7 @@ int main(int argc, char **argv) {
 
     printf("INSERT elapsed_time: %ld, Avg: %f\n", elapsed_time,
            (double)elapsed_time / num_data);
+    print_persist_stats(num_data);
   }
 
   clear_cache();
@@ -55,7 +55,7 @@ public:
   btree();
   void constructor(PMEMobjpool *);
   void setNewRoot(TOID(page));
-  void btree_insert(entry_key_t, char *);
+  bool btree_insert(entry_key_t, char *, bool upsert = false);
   void btree_insert_internal(char *, entry_key_t, char *, uint32_t);
   void btree_delete(entry_key_t);
   void btree_delete_internal(entry_key_t, char *, uint32_t, entry_key_t *,
@@ -495,21 +495,56 @@ public:
     ++(*num_entries);
   }
 
-  // Insert a new key - FAST and FAIR
+  // Slot of key among the first n entries of this leaf, -1 if it is not
+  // there. No shift is under way during a store, so the keys are in order.
+  inline int find_key(entry_key_t key, int n) {
+    int lo = 0, hi = n;
+    while (lo < hi) {
+      int mid = (lo + hi) / 2;
+      if (records[mid].key < key) {
+        lo = mid + 1;
+      } else {
+        hi = mid;
+      }
+    }
+    return (lo < n && records[lo].key == key) ? lo : -1;
+  }
+
+  // Insert a new key - FAST and FAIR. A key already in the leaf is not
+  // inserted again: *existed is set and, with upsert, its value is
+  // overwritten in place instead.
   page *store(btree *bt, char *left, entry_key_t key, char *right, bool flush,
-              page *invalid_sibling = NULL) {
+              page *invalid_sibling = NULL, bool upsert = false,
+              bool *existed = NULL) {
     // If this node has a sibling node,
     if ((hdr.sibling_ptr.oid.off != 0) &&
         ((page *)hdr.sibling_ptr.oid.off != invalid_sibling)) {
-      // Compare this key with the first key of the sibling
-      if (key > D_RO(hdr.sibling_ptr)->records[0].key) {
+      // Compare this key with the first key of the sibling; in a leaf an
+      // equal key is the sibling's
+      entry_key_t first = D_RO(hdr.sibling_ptr)->records[0].key;
+      if (key > first || (key == first && hdr.leftmost_ptr == NULL)) {
         return D_RW(hdr.sibling_ptr)
-            ->store(bt, NULL, key, right, true, invalid_sibling);
+            ->store(bt, NULL, key, right, true, invalid_sibling, upsert,
+                    existed);
       }
     }
 
     register int num_entries = count();
 
+    if (hdr.leftmost_ptr == NULL) {
+      int i = find_key(key, num_entries);
+      if (i >= 0) {
+        if (upsert) {
+          records[i].ptr = right;
+          pmemobj_persist(bt->pop, &records[i].ptr, sizeof(char *));
+        }
+        if (existed) {
+          *existed = true;
+        }
+        return this;
+      }
+    }
+
     // FAST
     if (num_entries < cardinality - 1) {
       insert_key(bt->pop, key, right, &num_entries, flush);
@@ -881,17 +916,21 @@ char *btree::btree_search(entry_key_t key) {
   return (char *)t;
 }
 
-// insert the key in the leaf node
-void btree::btree_insert(entry_key_t key, char *right) {
+// insert the key in the leaf node; false if it is already in the tree, in
+// which case only upsert overwrites its value
+bool btree::btree_insert(entry_key_t key, char *right, bool upsert) {
   TOID(page) p = root;
 
   while (D_RO(p)->hdr.leftmost_ptr != NULL) {
     p.oid.off = (uint64_t)D_RW(p)->linear_search(key);
   }
 
-  if (!D_RW(p)->store(this, NULL, key, right, true)) { // store
-    btree_insert(key, right);
+  bool existed = false;
+  if (!D_RW(p)->store(this, NULL, key, right, true, NULL, upsert,
+                      &existed)) { // store
+    return btree_insert(key, right, upsert);
   }
+  return !existed;
 }
 
 // store the key into the node at the given level